@@ -142,7 +142,7 @@ int main(int argc, char **argv) {
 
 		/* gpio change */
 		if ((fdset[0].revents & POLLIN) != 0) {
-			struct gpioevent_data event;
+			struct gpio_v2_line_event event;
 
 			ret = read(gpios[GPIO_IRQ].evfd, &event, sizeof(event));
 			if (ret < 0) {
@@ -150,7 +150,7 @@ int main(int argc, char **argv) {
 				return 1;
 			}
 
-			if (event.id == GPIOEVENT_EVENT_RISING_EDGE)
+			if (event.id == GPIO_V2_LINE_EVENT_RISING_EDGE)
 				irqstate = 1;
 			else
 				irqstate = 0;
@@ -27,9 +27,21 @@
 #define MQTT_USERNAME ""
 #define MQTT_PASSWORD ""
 #define MQTT_KEEPALIVE_SECONDS 60
+#define MQTT_RECONNECT_DELAY_MIN 500
+#define MQTT_RECONNECT_DELAY_MAX 60000
+
+#define LATENCY_TRACE 0
+
+#define GPIO_RESYNC_INTERVAL 60
+
+#define LOCALBUS_DIR "/run/acs-bus"
 
 #define I2C_LEDS_BUS 1
 #define I2C_LEDS_DEV 0x23
+#define I2C_LEDS_BURST 8
+#define I2C_LEDS_VERIFY 1
+#define I2C_LEDS_SCENE ""
+#define I2C_LEDS_SEGMENTS 1
 
 #define ABUS_CFA1000_I2C_BUS 1
 #define ABUS_CFA1000_I2C_DEV 0x20
@@ -0,0 +1,97 @@
+/*
+ * Access Control System - Sensor edge records
+ *
+ * Copyright (c) 2016, Sebastian Reichel <sre@mainframe.io>
+ *
+ * Permission to use, copy, modify, and/or distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY
+ * SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN ACTION
+ * OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF OR IN
+ * CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "edge.h"
+
+static uint64_t edge_clock(clockid_t clock) {
+	struct timespec ts;
+
+	clock_gettime(clock, &ts);
+	return (uint64_t) ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+/* edges are reported in CLOCK_MONOTONIC, shift them by the current offset */
+uint64_t edge_realtime(uint64_t monotonic) {
+	uint64_t mono = edge_clock(CLOCK_MONOTONIC);
+	uint64_t real = edge_clock(CLOCK_REALTIME);
+
+	if (monotonic > mono)
+		return real;
+
+	return real - (mono - monotonic);
+}
+
+static void put_be(uint8_t *buf, uint64_t value, int bytes) {
+	int i;
+
+	for (i = 0; i < bytes; i++)
+		buf[i] = value >> (8 * (bytes - 1 - i));
+}
+
+static uint64_t get_be(const uint8_t *buf, int bytes) {
+	uint64_t value = 0;
+	int i;
+
+	for (i = 0; i < bytes; i++)
+		value = (value << 8) | buf[i];
+
+	return value;
+}
+
+/* [version] [value] [seq:32] [lost:32] [timestamp:64], big endian */
+int edge_pack(const struct edge_record *e, uint8_t *buf, size_t len) {
+	if (len < EDGE_SIZE)
+		return -1;
+
+	buf[0] = EDGE_VERSION;
+	buf[1] = e->value;
+	put_be(buf + 2, e->seq, 4);
+	put_be(buf + 6, e->lost, 4);
+	put_be(buf + 10, e->timestamp, 8);
+
+	return EDGE_SIZE;
+}
+
+bool edge_unpack(struct edge_record *e, const void *data, size_t len) {
+	const uint8_t *buf = data;
+
+	if (len < EDGE_SIZE || buf[0] != EDGE_VERSION)
+		return false;
+
+	e->value = buf[1];
+	e->seq = get_be(buf + 2, 4);
+	e->lost = get_be(buf + 6, 4);
+	e->timestamp = get_be(buf + 10, 8);
+
+	return true;
+}
+
+char *edge_topic(const char *topic) {
+	size_t len = strlen(topic) + strlen(EDGE_SUFFIX) + 1;
+	char *result = malloc(len);
+
+	if (result)
+		snprintf(result, len, "%s%s", topic, EDGE_SUFFIX);
+
+	return result;
+}
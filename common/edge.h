@@ -0,0 +1,31 @@
+#ifndef __EDGE_H
+#define __EDGE_H
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <stddef.h>
+
+/*
+ * Sensor edge record, published on "<topic>" EDGE_SUFFIX after every state
+ * change. seq counts the publications of the line, so a gap means a lost
+ * message, while lost counts edges the kernel dropped from its event FIFO.
+ * The kernel timestamp is converted to CLOCK_REALTIME nanoseconds, so
+ * records from different hosts can be put into order.
+ */
+#define EDGE_SUFFIX "/event"
+#define EDGE_VERSION 1
+#define EDGE_SIZE 18
+
+struct edge_record {
+	bool value;
+	uint32_t seq;
+	uint32_t lost;
+	uint64_t timestamp;
+};
+
+uint64_t edge_realtime(uint64_t monotonic);
+int edge_pack(const struct edge_record *e, uint8_t *buf, size_t len);
+bool edge_unpack(struct edge_record *e, const void *buf, size_t len);
+char *edge_topic(const char *topic);
+
+#endif
@@ -0,0 +1,106 @@
+/*
+ * Access Control System - Latency histograms
+ *
+ * Copyright (c) 2016, Sebastian Reichel <sre@mainframe.io>
+ *
+ * Permission to use, copy, modify, and/or distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY
+ * SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN ACTION
+ * OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF OR IN
+ * CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#include <string.h>
+#include <inttypes.h>
+
+#include "histogram.h"
+
+static unsigned int histogram_index(uint32_t value) {
+	unsigned int msb, shift;
+
+	if (value < HISTOGRAM_SUB_COUNT)
+		return value;
+
+	msb = 31 - __builtin_clz(value);
+	shift = msb - HISTOGRAM_SUB_BITS;
+
+	return (shift + 1) * HISTOGRAM_SUB_COUNT + ((value >> shift) - HISTOGRAM_SUB_COUNT);
+}
+
+/* highest value falling into bucket idx */
+static uint32_t histogram_bucket_max(unsigned int idx) {
+	unsigned int shift;
+	uint64_t top;
+
+	if (idx < HISTOGRAM_SUB_COUNT)
+		return idx;
+
+	shift = idx / HISTOGRAM_SUB_COUNT - 1;
+	top = HISTOGRAM_SUB_COUNT + idx % HISTOGRAM_SUB_COUNT;
+
+	return ((top + 1) << shift) - 1;
+}
+
+void histogram_init(struct histogram *h, const char *name) {
+	h->name = name;
+	histogram_reset(h);
+}
+
+void histogram_reset(struct histogram *h) {
+	h->count = 0;
+	h->sum = 0;
+	h->min = UINT32_MAX;
+	h->max = 0;
+	memset(h->buckets, 0, sizeof(h->buckets));
+}
+
+void histogram_record(struct histogram *h, uint64_t value) {
+	uint32_t v = (value > UINT32_MAX) ? UINT32_MAX : value;
+
+	h->buckets[histogram_index(v)]++;
+	h->count++;
+	h->sum += v;
+
+	if (v < h->min)
+		h->min = v;
+	if (v > h->max)
+		h->max = v;
+}
+
+uint32_t histogram_percentile(const struct histogram *h, double percentile) {
+	uint64_t wanted, seen = 0;
+	unsigned int i;
+
+	if (!h->count)
+		return 0;
+
+	wanted = (h->count * percentile) / 100.0 + 0.5;
+	if (wanted < 1)
+		wanted = 1;
+
+	for (i = 0; i < HISTOGRAM_BUCKETS; i++) {
+		seen += h->buckets[i];
+		if (seen >= wanted) {
+			uint32_t val = histogram_bucket_max(i);
+			return (val > h->max) ? h->max : val;
+		}
+	}
+
+	return h->max;
+}
+
+int histogram_format(const struct histogram *h, char *buf, size_t len) {
+	if (!h->count)
+		return snprintf(buf, len, "%s: no samples\n", h->name);
+
+	return snprintf(buf, len, "%s: n=%" PRIu64 " min=%" PRIu32 " avg=%" PRIu64 " p50=%" PRIu32 " p90=%" PRIu32 " p99=%" PRIu32 " max=%" PRIu32 "\n",
+		h->name, h->count, h->min, h->sum / h->count,
+		histogram_percentile(h, 50), histogram_percentile(h, 90),
+		histogram_percentile(h, 99), h->max);
+}
@@ -0,0 +1,31 @@
+#ifndef __HISTOGRAM_H
+#define __HISTOGRAM_H
+
+#include <stdio.h>
+#include <stdint.h>
+
+/*
+ * HDR style log-linear histogram: every power of two is split into
+ * 2^HISTOGRAM_SUB_BITS buckets, so the relative error stays below ~6%
+ * for values between 0 and 2^32-1.
+ */
+#define HISTOGRAM_SUB_BITS 4
+#define HISTOGRAM_SUB_COUNT (1 << HISTOGRAM_SUB_BITS)
+#define HISTOGRAM_BUCKETS ((32 - HISTOGRAM_SUB_BITS + 1) * HISTOGRAM_SUB_COUNT)
+
+struct histogram {
+	const char *name;
+	uint64_t count;
+	uint64_t sum;
+	uint32_t min;
+	uint32_t max;
+	uint32_t buckets[HISTOGRAM_BUCKETS];
+};
+
+void histogram_init(struct histogram *h, const char *name);
+void histogram_reset(struct histogram *h);
+void histogram_record(struct histogram *h, uint64_t value);
+uint32_t histogram_percentile(const struct histogram *h, double percentile);
+int histogram_format(const struct histogram *h, char *buf, size_t len);
+
+#endif
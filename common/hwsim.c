@@ -0,0 +1,714 @@
+/*
+ * Access Control System - Hardware backends and simulator
+ *
+ * Copyright (c) 2016, Sebastian Reichel <sre@mainframe.io>
+ *
+ * Permission to use, copy, modify, and/or distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY
+ * SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN ACTION
+ * OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF OR IN
+ * CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/socket.h>
+#include <sys/eventfd.h>
+#include <linux/gpio.h>
+
+#include "hwsim.h"
+
+#define HWSIM_MAX_LINES 64
+#define HWSIM_MAX_REQUESTS 16
+#define HWSIM_MAX_DEVICES 8
+#define HWSIM_MAX_HANDLES 16
+#define HWSIM_MAX_SCRIPT 4096
+#define HWSIM_MAX_REPEAT 8
+
+#define MCP23017_IODIR_A 0x00
+#define MCP23017_GPINTEN_A 0x04
+#define MCP23017_GPIO_A 0x12
+#define MCP23017_OLAT_A 0x14
+
+enum hwsim_model {
+	HWSIM_MCP23017,
+	HWSIM_WS2812,
+	HWSIM_CFA1000,
+};
+
+struct hwsim_line {
+	char *chip;
+	uint32_t offset;
+	bool value;
+	bool output;
+	int request;
+	uint32_t line_seqno;
+};
+
+struct hwsim_request {
+	int fd;
+	int simfd;
+	int count;
+	int lines[GPIO_V2_LINES_MAX];
+	uint32_t seqno;
+};
+
+/* LEDs with a command register and segments configured in tiny-led-firmware */
+#define WS2812_LEDS 36
+#define WS2812_SEGMENTS 8
+#define WS2812_REG_SEGMENT 0xc0
+#define WS2812_REG_SEGDEF 0xe0
+#define WS2812_REG_CHECKSUM 0xfe
+
+struct hwsim_device {
+	int bus;
+	int addr;
+	enum hwsim_model model;
+	uint8_t regs[256 * 4];
+	uint16_t inputs;
+	char *irq_chip;
+	uint32_t irq_offset;
+};
+
+struct hwsim_handle {
+	int fd;
+	struct hwsim_device *dev;
+};
+
+static pthread_once_t hwsim_once = PTHREAD_ONCE_INIT;
+static pthread_mutex_t hwsim_lock = PTHREAD_MUTEX_INITIALIZER;
+static enum hw_backend backend;
+
+static struct hwsim_line lines[HWSIM_MAX_LINES];
+static int line_count;
+static struct hwsim_request requests[HWSIM_MAX_REQUESTS];
+static int request_count;
+static struct hwsim_device devices[HWSIM_MAX_DEVICES];
+static int device_count;
+static struct hwsim_handle handles[HWSIM_MAX_HANDLES];
+static int handle_count;
+
+static char *script[HWSIM_MAX_SCRIPT];
+static int script_len;
+static pthread_t script_thread;
+
+/* CFA1000 segment patterns, GPIOA in the low and GPIOB in the high byte */
+static const struct {
+	char symbol;
+	uint16_t segments;
+} cfa1000_symbols[] = {
+	{ ' ', 0x0000 },
+	{ '1', 0x0404 },
+	{ '2', 0x4623 },
+	{ '3', 0x4625 },
+	{ '4', 0x6405 },
+	{ '/', 0x0810 },
+	{ '\\', 0x1080 },
+	{ '-', 0x4001 },
+	{ '|', 0x8008 },
+	{ 'M', 0x3c06 },
+};
+
+#define CFA1000_LOCKED 0x0040
+#define CFA1000_UNLOCKED 0x0100
+
+static uint64_t hwsim_now() {
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t) ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+/* called with hwsim_lock held */
+static int hwsim_line_get(const char *chip, uint32_t offset) {
+	int i;
+
+	for (i = 0; i < line_count; i++)
+		if (lines[i].offset == offset && !strcmp(lines[i].chip, chip))
+			return i;
+
+	if (line_count == HWSIM_MAX_LINES)
+		return -ENOSPC;
+
+	lines[line_count].chip = strdup(chip);
+	lines[line_count].offset = offset;
+	lines[line_count].request = -1;
+
+	return line_count++;
+}
+
+/* called with hwsim_lock held, same record the kernel would queue */
+static void hwsim_line_set(int idx, bool value) {
+	struct hwsim_line *line = &lines[idx];
+	struct hwsim_request *req;
+	struct gpio_v2_line_event event;
+
+	if (line->value == value)
+		return;
+	line->value = value;
+
+	if (line->request < 0 || line->output)
+		return;
+	req = &requests[line->request];
+
+	memset(&event, 0, sizeof(event));
+	event.timestamp_ns = hwsim_now();
+	event.id = value ? GPIO_V2_LINE_EVENT_RISING_EDGE : GPIO_V2_LINE_EVENT_FALLING_EDGE;
+	event.offset = line->offset;
+	event.seqno = ++req->seqno;
+	event.line_seqno = ++line->line_seqno;
+
+	/* a full socket buffer drops the event like an overflowing kernel FIFO */
+	send(req->simfd, &event, sizeof(event), MSG_NOSIGNAL | MSG_DONTWAIT);
+}
+
+int hwsim_gpio_request(const char *chip, const uint32_t *offsets, int count, bool output, uint64_t values) {
+	struct hwsim_request *req;
+	int fds[2];
+	int i, idx, ret = 0;
+
+	if (count > GPIO_V2_LINES_MAX)
+		return -EINVAL;
+
+	pthread_mutex_lock(&hwsim_lock);
+
+	if (request_count == HWSIM_MAX_REQUESTS) {
+		ret = -ENOSPC;
+		goto out;
+	}
+
+	for (i = 0; i < count; i++) {
+		idx = hwsim_line_get(chip, offsets[i]);
+		if (idx < 0) {
+			ret = idx;
+			goto out;
+		}
+		if (lines[idx].request >= 0) {
+			ret = -EBUSY;
+			goto out;
+		}
+	}
+
+	if (socketpair(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0, fds)) {
+		ret = -errno;
+		goto out;
+	}
+
+	req = &requests[request_count];
+	req->fd = fds[0];
+	req->simfd = fds[1];
+	req->count = count;
+
+	for (i = 0; i < count; i++) {
+		idx = hwsim_line_get(chip, offsets[i]);
+		lines[idx].request = request_count;
+		lines[idx].output = output;
+		if (output)
+			lines[idx].value = (values >> i) & 1;
+		req->lines[i] = idx;
+	}
+
+	request_count++;
+	ret = fds[0];
+
+out:
+	pthread_mutex_unlock(&hwsim_lock);
+	return ret;
+}
+
+int hwsim_gpio_set(int fd, uint64_t bits, uint64_t mask) {
+	struct hwsim_line *line;
+	int i, j, ret = -EBADF;
+
+	pthread_mutex_lock(&hwsim_lock);
+
+	for (i = 0; i < request_count; i++) {
+		if (requests[i].fd != fd)
+			continue;
+
+		for (j = 0; j < requests[i].count; j++) {
+			if (!(mask & (1ULL << j)))
+				continue;
+
+			line = &lines[requests[i].lines[j]];
+			line->value = (bits >> j) & 1;
+			fprintf(stderr, "hwsim: %s %u = %d\n", line->chip, line->offset, line->value);
+		}
+
+		ret = 0;
+		break;
+	}
+
+	pthread_mutex_unlock(&hwsim_lock);
+	return ret;
+}
+
+int hwsim_gpio_get(int fd, uint64_t mask, uint64_t *bits) {
+	int i, j, ret = -EBADF;
+
+	pthread_mutex_lock(&hwsim_lock);
+
+	for (i = 0; i < request_count; i++) {
+		if (requests[i].fd != fd)
+			continue;
+
+		*bits = 0;
+		for (j = 0; j < requests[i].count; j++)
+			if ((mask & (1ULL << j)) && lines[requests[i].lines[j]].value)
+				*bits |= 1ULL << j;
+
+		ret = 0;
+		break;
+	}
+
+	pthread_mutex_unlock(&hwsim_lock);
+	return ret;
+}
+
+/* called with hwsim_lock held */
+static struct hwsim_device *hwsim_device_find(int bus, int addr) {
+	int i;
+
+	for (i = 0; i < device_count; i++)
+		if (devices[i].bus == bus && devices[i].addr == addr)
+			return &devices[i];
+
+	return NULL;
+}
+
+/* called with hwsim_lock held */
+static struct hwsim_device *hwsim_handle_find(int fd) {
+	int i;
+
+	for (i = 0; i < handle_count; i++)
+		if (handles[i].fd == fd)
+			return handles[i].dev;
+
+	return NULL;
+}
+
+int hwsim_i2c_open(int bus, int addr) {
+	struct hwsim_device *dev;
+	int fd;
+
+	pthread_mutex_lock(&hwsim_lock);
+
+	dev = hwsim_device_find(bus, addr);
+	if (!dev) {
+		fd = -ENXIO;
+		goto out;
+	}
+
+	if (handle_count == HWSIM_MAX_HANDLES) {
+		fd = -EMFILE;
+		goto out;
+	}
+
+	/* the descriptor only serves as a unique handle */
+	fd = eventfd(0, EFD_CLOEXEC);
+	if (fd < 0) {
+		fd = -errno;
+		goto out;
+	}
+
+	handles[handle_count].fd = fd;
+	handles[handle_count].dev = dev;
+	handle_count++;
+
+out:
+	pthread_mutex_unlock(&hwsim_lock);
+	return fd;
+}
+
+int hwsim_i2c_close(int fd) {
+	int i;
+
+	pthread_mutex_lock(&hwsim_lock);
+
+	for (i = 0; i < handle_count; i++) {
+		if (handles[i].fd == fd) {
+			handles[i] = handles[--handle_count];
+			break;
+		}
+	}
+
+	pthread_mutex_unlock(&hwsim_lock);
+	return close(fd);
+}
+
+/* called with hwsim_lock held, pins configured as output read back OLAT */
+static uint8_t mcp23017_read(struct hwsim_device *dev, uint8_t reg) {
+	int port = reg - MCP23017_GPIO_A;
+	uint8_t iodir, in;
+
+	if (port != 0 && port != 1)
+		return dev->regs[reg];
+
+	iodir = dev->regs[MCP23017_IODIR_A + port];
+	in = dev->inputs >> (8 * port);
+	return (in & iodir) | (dev->regs[MCP23017_OLAT_A + port] & ~iodir);
+}
+
+/* called with hwsim_lock held */
+static void mcp23017_write(struct hwsim_device *dev, uint8_t reg, uint8_t val) {
+	if (reg == MCP23017_GPIO_A || reg == MCP23017_GPIO_A + 1)
+		reg += MCP23017_OLAT_A - MCP23017_GPIO_A;
+	dev->regs[reg] = val;
+}
+
+/* called with hwsim_lock held, pulses the interrupt line on enabled pins */
+static void mcp23017_input(struct hwsim_device *dev, uint16_t value) {
+	uint16_t changed = dev->inputs ^ value;
+	uint16_t enabled = dev->regs[MCP23017_GPINTEN_A] | dev->regs[MCP23017_GPINTEN_A + 1] << 8;
+	int irq;
+
+	dev->inputs = value;
+
+	if (!(changed & enabled) || !dev->irq_chip)
+		return;
+
+	irq = hwsim_line_get(dev->irq_chip, dev->irq_offset);
+	if (irq < 0)
+		return;
+
+	hwsim_line_set(irq, true);
+	hwsim_line_set(irq, false);
+}
+
+/* register an LED register reads as, the first segment covering the LED wins */
+static int ws2812_shown(struct hwsim_device *dev, int reg) {
+	uint8_t *def;
+	int s;
+
+	if (reg >= WS2812_LEDS)
+		return reg;
+
+	for (s = 0; s < WS2812_SEGMENTS; s++) {
+		def = &dev->regs[(WS2812_REG_SEGDEF + s) * 4];
+		if ((uint8_t) (reg - def[0]) < def[1])
+			return WS2812_REG_SEGMENT + s;
+	}
+
+	return reg;
+}
+
+/* tiny-ws2812 exposes every LED as 4 byte register, plus segment and checksum registers */
+static uint8_t ws2812_read(struct hwsim_device *dev, int pos) {
+	int len = dev->regs[WS2812_REG_CHECKSUM * 4];
+	uint16_t sum1 = 0, sum2 = 0;
+	int i;
+
+	pos %= sizeof(dev->regs);
+	if (pos / 4 != WS2812_REG_CHECKSUM)
+		return dev->regs[ws2812_shown(dev, pos / 4) * 4 + pos % 4];
+
+	if (!len || len > WS2812_LEDS)
+		len = WS2812_LEDS;
+
+	for (i = 0; i < len * 4; i++) {
+		sum1 = (sum1 + dev->regs[ws2812_shown(dev, i / 4) * 4 + i % 4]) % 255;
+		sum2 = (sum2 + sum1) % 255;
+	}
+
+	switch (pos % 4) {
+	case 0:
+		return sum2;
+	case 1:
+		return sum1;
+	case 2:
+		return len;
+	default:
+		return 0;
+	}
+}
+
+int hwsim_i2c_read(int fd, uint8_t reg, uint8_t *buf, int len) {
+	struct hwsim_device *dev;
+	int i;
+
+	pthread_mutex_lock(&hwsim_lock);
+
+	dev = hwsim_handle_find(fd);
+	if (!dev) {
+		pthread_mutex_unlock(&hwsim_lock);
+		return -EBADF;
+	}
+
+	for (i = 0; i < len; i++) {
+		if (dev->model == HWSIM_WS2812)
+			buf[i] = ws2812_read(dev, reg * 4 + i);
+		else
+			buf[i] = mcp23017_read(dev, (reg + i) & 0xff);
+	}
+
+	pthread_mutex_unlock(&hwsim_lock);
+	return len;
+}
+
+int hwsim_i2c_write(int fd, uint8_t reg, const uint8_t *buf, int len) {
+	struct hwsim_device *dev;
+	int i;
+
+	pthread_mutex_lock(&hwsim_lock);
+
+	dev = hwsim_handle_find(fd);
+	if (!dev) {
+		pthread_mutex_unlock(&hwsim_lock);
+		return -EBADF;
+	}
+
+	for (i = 0; i < len; i++) {
+		if (dev->model == HWSIM_WS2812)
+			dev->regs[(reg * 4 + i) % sizeof(dev->regs)] = buf[i];
+		else
+			mcp23017_write(dev, (reg + i) & 0xff, buf[i]);
+	}
+
+	pthread_mutex_unlock(&hwsim_lock);
+	return 0;
+}
+
+static int hwsim_add_device(int bus, int addr, const char *model, const char *irq_chip, int irq_offset) {
+	struct hwsim_device *dev;
+
+	if (device_count == HWSIM_MAX_DEVICES)
+		return -ENOSPC;
+
+	dev = &devices[device_count];
+	memset(dev, 0, sizeof(*dev));
+	dev->bus = bus;
+	dev->addr = addr;
+
+	if (!strcmp(model, "mcp23017"))
+		dev->model = HWSIM_MCP23017;
+	else if (!strcmp(model, "ws2812"))
+		dev->model = HWSIM_WS2812;
+	else if (!strcmp(model, "cfa1000"))
+		dev->model = HWSIM_CFA1000;
+	else
+		return -EINVAL;
+
+	/* MCP23017 power on default: all pins are inputs */
+	if (dev->model != HWSIM_WS2812) {
+		dev->regs[MCP23017_IODIR_A] = 0xff;
+		dev->regs[MCP23017_IODIR_A + 1] = 0xff;
+	}
+
+	if (irq_chip) {
+		dev->irq_chip = strdup(irq_chip);
+		dev->irq_offset = irq_offset;
+	}
+
+	device_count++;
+	return 0;
+}
+
+static int hwsim_display(struct hwsim_device *dev, char symbol, const char *state) {
+	uint16_t value;
+	int i, n = sizeof(cfa1000_symbols) / sizeof(cfa1000_symbols[0]);
+
+	for (i = 0; i < n; i++)
+		if (cfa1000_symbols[i].symbol == symbol)
+			break;
+	if (i == n)
+		return -EINVAL;
+
+	value = cfa1000_symbols[i].segments;
+	if (!strcmp(state, "locked"))
+		value |= CFA1000_LOCKED;
+	else if (!strcmp(state, "unlocked"))
+		value |= CFA1000_UNLOCKED;
+
+	mcp23017_input(dev, value);
+	return 0;
+}
+
+static void hwsim_sleep(struct timespec *next, unsigned int ms) {
+	next->tv_sec += ms / 1000;
+	next->tv_nsec += (ms % 1000) * 1000000L;
+	if (next->tv_nsec >= 1000000000L) {
+		next->tv_sec++;
+		next->tv_nsec -= 1000000000L;
+	}
+
+	while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, next, NULL) == EINTR)
+		;
+}
+
+/* runs one timed command, returns false on a syntax error */
+static bool hwsim_command(const char *cmd, struct timespec *next) {
+	struct hwsim_device *dev;
+	char name[128], arg[32];
+	unsigned int ms, offset, value;
+	int bus, addr, idx;
+
+	if (sscanf(cmd, "wait %u", &ms) == 1) {
+		hwsim_sleep(next, ms);
+		return true;
+	}
+
+	if (!strcmp(cmd, "exit")) {
+		fprintf(stderr, "hwsim: script finished, exiting\n");
+		exit(0);
+	}
+
+	pthread_mutex_lock(&hwsim_lock);
+
+	if (sscanf(cmd, "gpio %127s %u %u", name, &offset, &value) == 3) {
+		idx = hwsim_line_get(name, offset);
+		if (idx >= 0)
+			hwsim_line_set(idx, value);
+	} else if (sscanf(cmd, "input %i %i %i", &bus, &addr, &value) == 3) {
+		dev = hwsim_device_find(bus, addr);
+		if (dev)
+			mcp23017_input(dev, value);
+	} else if (sscanf(cmd, "display %i %i %c %31s", &bus, &addr, name, arg) == 4) {
+		dev = hwsim_device_find(bus, addr);
+		if (dev)
+			hwsim_display(dev, name[0], arg);
+	} else {
+		pthread_mutex_unlock(&hwsim_lock);
+		return false;
+	}
+
+	pthread_mutex_unlock(&hwsim_lock);
+	return true;
+}
+
+static void *hwsim_script_run(void *data) {
+	struct {
+		int start;
+		unsigned int left;
+	} loops[HWSIM_MAX_REPEAT];
+	struct timespec next;
+	unsigned int count;
+	int depth = 0;
+	int pc;
+
+	clock_gettime(CLOCK_MONOTONIC, &next);
+
+	for (pc = 0; pc < script_len; pc++) {
+		const char *cmd = script[pc];
+
+		if (!strncmp(cmd, "device ", 7))
+			continue;
+
+		if (sscanf(cmd, "repeat %u", &count) == 1) {
+			if (!count) {
+				fprintf(stderr, "hwsim: repeat needs a count\n");
+				break;
+			}
+			if (depth == HWSIM_MAX_REPEAT) {
+				fprintf(stderr, "hwsim: repeat nested too deep\n");
+				break;
+			}
+			loops[depth].start = pc;
+			loops[depth].left = count;
+			depth++;
+			continue;
+		}
+
+		if (!strcmp(cmd, "end")) {
+			if (!depth)
+				continue;
+			if (--loops[depth - 1].left > 0)
+				pc = loops[depth - 1].start;
+			else
+				depth--;
+			continue;
+		}
+
+		if (!hwsim_command(cmd, &next))
+			fprintf(stderr, "hwsim: invalid command: %s\n", cmd);
+	}
+
+	return NULL;
+}
+
+static int hwsim_script_load(const char *path) {
+	char line[256], model[32], chip[128];
+	int bus, addr, offset, n;
+	char *p;
+	FILE *f;
+
+	f = fopen(path, "r");
+	if (!f)
+		return -errno;
+
+	while (fgets(line, sizeof(line), f) && script_len < HWSIM_MAX_SCRIPT) {
+		p = strchr(line, '#');
+		if (p)
+			*p = '\0';
+		for (p = line + strlen(line); p > line && (p[-1] == '\n' || p[-1] == ' ' || p[-1] == '\t'); p--)
+			p[-1] = '\0';
+		for (p = line; *p == ' ' || *p == '\t'; p++)
+			;
+		if (!*p)
+			continue;
+
+		/* the device topology is static */
+		n = sscanf(p, "device %i %i %31s %127s %i", &bus, &addr, model, chip, &offset);
+		if (n >= 3 && hwsim_add_device(bus, addr, model, n == 5 ? chip : NULL, offset))
+			fprintf(stderr, "hwsim: invalid device: %s\n", p);
+
+		script[script_len++] = strdup(p);
+	}
+
+	fclose(f);
+	return 0;
+}
+
+static void hwsim_init() {
+	const char *name = getenv(HW_BACKEND_ENV);
+	const char *path;
+	int err;
+
+	backend = HW_BACKEND_KERNEL;
+	if (!name || !strcmp(name, "") || !strcmp(name, "kernel"))
+		return;
+
+	if (!strcmp(name, "gpio-sim")) {
+		backend = HW_BACKEND_GPIO_SIM;
+		return;
+	}
+
+	if (strcmp(name, "sim")) {
+		fprintf(stderr, "hwsim: unknown backend \"%s\", using kernel\n", name);
+		return;
+	}
+
+	backend = HW_BACKEND_SIM;
+
+	path = getenv(HWSIM_SCRIPT_ENV);
+	if (!path) {
+		fprintf(stderr, "hwsim: no script, simulating idle hardware\n");
+		return;
+	}
+
+	err = hwsim_script_load(path);
+	if (err) {
+		fprintf(stderr, "hwsim: could not load %s: %s\n", path, strerror(-err));
+		return;
+	}
+
+	if (pthread_create(&script_thread, NULL, hwsim_script_run, NULL))
+		fprintf(stderr, "hwsim: could not start script\n");
+}
+
+enum hw_backend hw_backend() {
+	pthread_once(&hwsim_once, hwsim_init);
+	return backend;
+}
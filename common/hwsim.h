@@ -0,0 +1,53 @@
+#ifndef __HWSIM_H
+#define __HWSIM_H
+
+#include <stdint.h>
+#include <stdbool.h>
+
+/*
+ * Hardware backend selection for keyboard/gpio.c and common/i2c.c, taken
+ * from the environment so daemons can run off the Pi without changes:
+ *
+ *   ACS_HW_BACKEND=kernel    /dev/gpiochip* and /dev/i2c-* (default)
+ *   ACS_HW_BACKEND=gpio-sim  kernel devices, but gpiochips are matched by
+ *                            their chip label, so gpio-sim banks (configfs)
+ *                            can be labelled e.g. "i2c/1-0021"
+ *   ACS_HW_BACKEND=sim       in-process simulator driven by the script in
+ *                            ACS_HWSIM_SCRIPT
+ *
+ * Simulator script, one command per line, '#' starts a comment:
+ *
+ *   device <bus> <addr> mcp23017|ws2812|cfa1000 [<irq-chip> <irq-offset>]
+ *   wait <ms>
+ *   gpio <chip> <offset> <0|1>
+ *   input <bus> <addr> <port value>
+ *   display <bus> <addr> <symbol> locked|unlocked|unknown
+ *   repeat <count>
+ *   end
+ *   exit
+ *
+ * Devices exist from the start, all other commands run in order in a
+ * separate thread. Waits add up to an absolute schedule, so timing does
+ * not drift with the load of the daemon under test.
+ */
+#define HW_BACKEND_ENV "ACS_HW_BACKEND"
+#define HWSIM_SCRIPT_ENV "ACS_HWSIM_SCRIPT"
+
+enum hw_backend {
+	HW_BACKEND_KERNEL,
+	HW_BACKEND_GPIO_SIM,
+	HW_BACKEND_SIM,
+};
+
+enum hw_backend hw_backend();
+
+int hwsim_gpio_request(const char *chip, const uint32_t *offsets, int count, bool output, uint64_t values);
+int hwsim_gpio_set(int fd, uint64_t bits, uint64_t mask);
+int hwsim_gpio_get(int fd, uint64_t mask, uint64_t *bits);
+
+int hwsim_i2c_open(int bus, int addr);
+int hwsim_i2c_close(int fd);
+int hwsim_i2c_read(int fd, uint8_t reg, uint8_t *buf, int len);
+int hwsim_i2c_write(int fd, uint8_t reg, const uint8_t *buf, int len);
+
+#endif
@@ -5,13 +5,18 @@
 #include <linux/i2c-dev.h>
 #include <stdio.h>
 #include <errno.h>
+#include <string.h>
 #include <arpa/inet.h>
 
 #include "i2c.h"
+#include "hwsim.h"
 
 int i2c_open(int bus, int dev) {
 	int file;
 	char filename[20];
+
+	if (hw_backend() == HW_BACKEND_SIM)
+		return hwsim_i2c_open(bus, dev);
   
 	sprintf(filename,"/dev/i2c-%d", bus);
 	if ((file = open(filename,O_RDWR)) < 0)
@@ -24,33 +29,196 @@ int i2c_open(int bus, int dev) {
 }
 
 int i2c_close(int file) {
+	if (hw_backend() == HW_BACKEND_SIM)
+		return hwsim_i2c_close(file);
+
 	return close(file);
 }
 
 int i2c_write(int file, uint8_t reg, uint8_t val) {
+	if (hw_backend() == HW_BACKEND_SIM)
+		return hwsim_i2c_write(file, reg, &val, 1);
+
 	return i2c_smbus_write_byte_data(file, reg, val);
 }
 
 int i2c_read(int file, uint8_t reg) {
+	uint8_t val;
+	int ret;
+
+	if (hw_backend() == HW_BACKEND_SIM) {
+		ret = hwsim_i2c_read(file, reg, &val, 1);
+		return ret < 0 ? ret : val;
+	}
+
 	return i2c_smbus_read_byte_data(file, reg);
 }
 
+/* SMBus words are transferred low byte first */
 int i2c_write16(int file, uint8_t reg, uint16_t val) {
+	uint8_t buf[2] = { val & 0xff, val >> 8 };
+
+	if (hw_backend() == HW_BACKEND_SIM)
+		return hwsim_i2c_write(file, reg, buf, 2);
+
 	return i2c_smbus_write_word_data(file, reg, val);
 }
 
 int i2c_read16(int file, uint8_t reg) {
+	uint8_t buf[2];
+	int ret;
+
+	if (hw_backend() == HW_BACKEND_SIM) {
+		ret = hwsim_i2c_read(file, reg, buf, 2);
+		return ret < 0 ? ret : buf[0] | buf[1] << 8;
+	}
+
 	return i2c_smbus_read_word_data(file, reg);
 }
 
+int i2c_write_block(int file, uint8_t reg, uint8_t len, const uint8_t *buf) {
+	if (hw_backend() == HW_BACKEND_SIM)
+		return hwsim_i2c_write(file, reg, buf, len);
+
+	return i2c_smbus_write_i2c_block_data(file, reg, len, buf);
+}
+
+/* one plain I2C message [reg] [buf], not limited to the SMBus block size */
+int i2c_write_raw(int file, uint8_t reg, int len, const uint8_t *buf) {
+	uint8_t msg[len + 1];
+	ssize_t ret;
+
+	if (hw_backend() == HW_BACKEND_SIM)
+		return hwsim_i2c_write(file, reg, buf, len);
+
+	msg[0] = reg;
+	memcpy(msg + 1, buf, len);
+
+	ret = write(file, msg, len + 1);
+	if (ret < 0)
+		return -errno;
+	if (ret != len + 1)
+		return -EIO;
+
+	return 0;
+}
+
+/* SMBus-only adapters reject plain messages */
+int i2c_plain_supported(int file) {
+	unsigned long funcs;
+
+	if (hw_backend() == HW_BACKEND_SIM)
+		return 1;
+
+	if (ioctl(file, I2C_FUNCS, &funcs) < 0)
+		return 0;
+
+	return !!(funcs & I2C_FUNC_I2C);
+}
+
+/* register address, then a plain read continuing from there */
+static int i2c_read_raw(int file, uint8_t reg, int len, uint8_t *buf) {
+	ssize_t ret;
+
+	if (hw_backend() == HW_BACKEND_SIM)
+		return hwsim_i2c_read(file, reg, buf, len);
+
+	if (write(file, &reg, 1) != 1)
+		return -errno;
+
+	ret = read(file, buf, len);
+	if (ret < 0)
+		return -errno;
+	if (ret != len)
+		return -EIO;
+
+	return 0;
+}
+
+/* every segment as its own transaction */
+static int i2c_transfer_single(int file, struct i2c_segment *segs, int count) {
+	struct i2c_segment *seg;
+	int i, ret;
+
+	for (i = 0; i < count; i++) {
+		seg = &segs[i];
+
+		if (seg->read && seg->len <= I2C_SMBUS_BLOCK_MAX)
+			ret = i2c_read_block(file, seg->reg, seg->len, seg->buf);
+		else if (seg->read)
+			ret = i2c_read_raw(file, seg->reg, seg->len, seg->buf);
+		else if (seg->len <= I2C_SMBUS_BLOCK_MAX)
+			ret = i2c_write_block(file, seg->reg, seg->len, seg->buf);
+		else
+			ret = i2c_write_raw(file, seg->reg, seg->len, seg->buf);
+
+		if (ret < 0)
+			return ret;
+	}
+
+	return 0;
+}
+
+/*
+ * All segments with a single I2C_RDWR ioctl, i.e. one syscall and one
+ * stop condition. Adapters without plain I2C support (see
+ * i2c_plain_supported(), callers cache the result) get one transaction
+ * per segment instead.
+ */
+int i2c_transfer(int file, int addr, bool plain, struct i2c_segment *segs, int count) {
+	struct i2c_msg msgs[2 * I2C_SEGMENTS_MAX];
+	struct i2c_rdwr_ioctl_data data = { .msgs = msgs, .nmsgs = 0 };
+	size_t size = 0;
+	uint8_t *p;
+	int i;
+
+	if (count > I2C_SEGMENTS_MAX)
+		return -EINVAL;
+
+	if (!plain || hw_backend() == HW_BACKEND_SIM)
+		return i2c_transfer_single(file, segs, count);
+
+	for (i = 0; i < count; i++)
+		size += segs[i].read ? 1 : segs[i].len + 1;
+
+	uint8_t scratch[size];
+	p = scratch;
+
+	for (i = 0; i < count; i++) {
+		p[0] = segs[i].reg;
+
+		if (segs[i].read) {
+			msgs[data.nmsgs++] = (struct i2c_msg) { .addr = addr, .flags = 0, .len = 1, .buf = p };
+			msgs[data.nmsgs++] = (struct i2c_msg) { .addr = addr, .flags = I2C_M_RD, .len = segs[i].len, .buf = segs[i].buf };
+			p += 1;
+		} else {
+			memcpy(p + 1, segs[i].buf, segs[i].len);
+			msgs[data.nmsgs++] = (struct i2c_msg) { .addr = addr, .flags = 0, .len = segs[i].len + 1, .buf = p };
+			p += segs[i].len + 1;
+		}
+	}
+
+	if (ioctl(file, I2C_RDWR, &data) < 0)
+		return -errno;
+
+	return 0;
+}
+
+int i2c_read_block(int file, uint8_t reg, uint8_t len, uint8_t *buf) {
+	if (hw_backend() == HW_BACKEND_SIM)
+		return hwsim_i2c_read(file, reg, buf, len);
+
+	return i2c_smbus_read_i2c_block_data(file, reg, len, buf);
+}
+
 int i2c_write32(int file, uint8_t reg, uint32_t data) {
 	data = htonl(data);
-	return i2c_smbus_write_i2c_block_data(file, reg, 4, (uint8_t*) &data);
+	return i2c_write_block(file, reg, 4, (uint8_t*) &data);
 }
 
 uint32_t i2c_read32(int file, uint8_t reg) {
 	uint32_t data;
-	i2c_smbus_read_i2c_block_data(file, reg, 4, (uint8_t*) &data);
+	i2c_read_block(file, reg, 4, (uint8_t*) &data);
 	data = ntohl(data);
 	return data;
 }
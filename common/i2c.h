@@ -2,6 +2,18 @@
 #define __I2C_H
 
 #include <stdint.h>
+#include <stdbool.h>
+
+/* I2C_RDWR takes at most 42 messages, a read needs two */
+#define I2C_SEGMENTS_MAX 20
+
+/* one part of a combined transfer, reads use a repeated start */
+struct i2c_segment {
+	uint8_t reg;
+	bool read;
+	int len;
+	uint8_t *buf;
+};
 
 int i2c_open(int bus, int dev);
 int i2c_close(int file);
@@ -9,6 +21,11 @@ int i2c_read(int file, uint8_t reg);
 int i2c_write(int file, uint8_t reg, uint8_t val);
 int i2c_read16(int file, uint8_t reg);
 int i2c_write16(int file, uint8_t reg, uint16_t val);
+int i2c_read_block(int file, uint8_t reg, uint8_t len, uint8_t *buf);
+int i2c_write_block(int file, uint8_t reg, uint8_t len, const uint8_t *buf);
+int i2c_write_raw(int file, uint8_t reg, int len, const uint8_t *buf);
+int i2c_plain_supported(int file);
+int i2c_transfer(int file, int addr, bool plain, struct i2c_segment *segs, int count);
 int i2c_write32(int file, uint8_t reg, uint32_t data);
 uint32_t i2c_read32(int file, uint8_t reg);
 
@@ -0,0 +1,322 @@
+/*
+ * Access Control System - Local unix domain pub/sub bus
+ *
+ * Copyright (c) 2016, Sebastian Reichel <sre@mainframe.io>
+ *
+ * Permission to use, copy, modify, and/or distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY
+ * SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN ACTION
+ * OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF OR IN
+ * CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <dirent.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/socket.h>
+
+#include "localbus.h"
+
+#define LOCALBUS_VERSION 1
+#define LOCALBUS_FLAG_RETAIN 0x01
+#define LOCALBUS_HEADER 4
+
+static uint64_t localbus_now() {
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t) ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+/* FNV-1a over topic and payload */
+static uint32_t localbus_hash(const char *topic, const void *payload, int payloadlen) {
+	const uint8_t *p = payload;
+	uint32_t hash = 2166136261u;
+	int i;
+
+	for (; *topic; topic++)
+		hash = (hash ^ (uint8_t) *topic) * 16777619u;
+	hash = (hash ^ 0) * 16777619u;
+	for (i = 0; i < payloadlen; i++)
+		hash = (hash ^ p[i]) * 16777619u;
+
+	return hash ? hash : 1;
+}
+
+void localbus_init(struct localbus *bus, struct mosquitto *mosq, void *udata, localbus_cb cb) {
+	memset(bus, 0, sizeof(*bus));
+	pthread_mutex_init(&bus->lock, NULL);
+
+	bus->fd = -1;
+	bus->mosq = mosq;
+	bus->udata = udata;
+	bus->cb = cb;
+}
+
+/* an empty dir disables the bus, name is NULL for publish-only users */
+int localbus_open(struct localbus *bus, const char *dir, const char *name) {
+	struct sockaddr_un addr;
+	int ret;
+
+	if (!dir || !*dir)
+		return 0;
+
+	if (mkdir(dir, 0770) && errno != EEXIST)
+		return -errno;
+
+	bus->dir = strdup(dir);
+	if (!bus->dir)
+		return -ENOMEM;
+
+	bus->fd = socket(AF_UNIX, SOCK_DGRAM | SOCK_CLOEXEC, 0);
+	if (bus->fd < 0)
+		return -errno;
+
+	if (!name)
+		return 0;
+
+	memset(&addr, 0, sizeof(addr));
+	addr.sun_family = AF_UNIX;
+	ret = snprintf(addr.sun_path, sizeof(addr.sun_path), "%s/%s", dir, name);
+	if (ret >= sizeof(addr.sun_path)) {
+		ret = -ENAMETOOLONG;
+		goto fail;
+	}
+
+	/* left over from a previous instance */
+	unlink(addr.sun_path);
+
+	if (bind(bus->fd, (struct sockaddr *) &addr, sizeof(addr))) {
+		ret = -errno;
+		goto fail;
+	}
+
+	bus->path = strdup(addr.sun_path);
+	if (!bus->path) {
+		ret = -ENOMEM;
+		goto fail;
+	}
+
+	return 0;
+
+fail:
+	close(bus->fd);
+	bus->fd = -1;
+	return ret;
+}
+
+bool localbus_enabled(struct localbus *bus) {
+	return bus->fd >= 0;
+}
+
+int localbus_subscribe(struct localbus *bus, const char *topic) {
+	if (bus->topic_count == LOCALBUS_MAX_TOPICS)
+		return -ENOSPC;
+
+	bus->topics[bus->topic_count] = strdup(topic);
+	if (!bus->topics[bus->topic_count])
+		return -ENOMEM;
+	bus->topic_count++;
+
+	return 0;
+}
+
+static bool localbus_subscribed(struct localbus *bus, const char *topic) {
+	int i;
+
+	for (i = 0; i < bus->topic_count; i++)
+		if (!strcmp(bus->topics[i], topic))
+			return true;
+
+	return false;
+}
+
+static void localbus_scan_peers(struct localbus *bus) {
+	struct sockaddr_un *addr;
+	struct dirent *entry;
+	DIR *dir;
+	int ret;
+
+	bus->peer_count = 0;
+
+	dir = opendir(bus->dir);
+	if (!dir)
+		return;
+
+	while ((entry = readdir(dir)) && bus->peer_count < LOCALBUS_MAX_PEERS) {
+		if (entry->d_type != DT_SOCK && entry->d_type != DT_UNKNOWN)
+			continue;
+		if (entry->d_name[0] == '.')
+			continue;
+
+		addr = &bus->peers[bus->peer_count];
+		memset(addr, 0, sizeof(*addr));
+		addr->sun_family = AF_UNIX;
+		ret = snprintf(addr->sun_path, sizeof(addr->sun_path), "%s/%s", bus->dir, entry->d_name);
+		if (ret >= sizeof(addr->sun_path))
+			continue;
+
+		/* do not deliver our own messages */
+		if (bus->path && !strcmp(bus->path, addr->sun_path))
+			continue;
+
+		bus->peer_count++;
+	}
+
+	closedir(dir);
+}
+
+/* called on every publish, only rescans when a subscriber came or went */
+static void localbus_update_peers(struct localbus *bus) {
+	struct stat st;
+
+	if (stat(bus->dir, &st))
+		return;
+
+	if (st.st_mtim.tv_sec == bus->peer_mtime.tv_sec && st.st_mtim.tv_nsec == bus->peer_mtime.tv_nsec)
+		return;
+
+	bus->peer_mtime = st.st_mtim;
+	localbus_scan_peers(bus);
+}
+
+/* [version] [flags] [topic len:16] [topic] [payload] */
+int localbus_publish(struct localbus *bus, const char *topic, int payloadlen, const void *payload, bool retain) {
+	uint8_t buf[LOCALBUS_MAX_MSG];
+	size_t topiclen = strlen(topic);
+	size_t len = LOCALBUS_HEADER + topiclen + payloadlen;
+	int i, ret;
+
+	if (!localbus_enabled(bus))
+		return 0;
+
+	if (len > sizeof(buf))
+		return -EMSGSIZE;
+
+	buf[0] = LOCALBUS_VERSION;
+	buf[1] = retain ? LOCALBUS_FLAG_RETAIN : 0;
+	buf[2] = topiclen >> 8;
+	buf[3] = topiclen & 0xff;
+	memcpy(buf + LOCALBUS_HEADER, topic, topiclen);
+	memcpy(buf + LOCALBUS_HEADER + topiclen, payload, payloadlen);
+
+	localbus_update_peers(bus);
+
+	for (i = 0; i < bus->peer_count; i++) {
+		ret = sendto(bus->fd, buf, len, MSG_DONTWAIT, (struct sockaddr *) &bus->peers[i], sizeof(bus->peers[i]));
+		if (ret >= 0)
+			continue;
+
+		/* stale socket of a stopped subscriber or a full receive queue */
+		if (errno != ECONNREFUSED && errno != ENOENT)
+			fprintf(stderr, "localbus: could not send %s to %s: %s\n", topic, bus->peers[i].sun_path, strerror(errno));
+		bus->dropped++;
+	}
+
+	return 0;
+}
+
+/* called with bus->lock held */
+static void localbus_remember(struct localbus *bus, uint32_t hash) {
+	bus->recent[bus->recent_next].hash = hash;
+	bus->recent[bus->recent_next].stamp = localbus_now();
+	bus->recent_next = (bus->recent_next + 1) % LOCALBUS_DEDUPE_SIZE;
+}
+
+/* called with bus->lock held, consumes the oldest matching local record */
+static bool localbus_forget(struct localbus *bus, uint32_t hash) {
+	uint64_t now = localbus_now();
+	int i, idx;
+
+	for (i = 0; i < LOCALBUS_DEDUPE_SIZE; i++) {
+		idx = (bus->recent_next + i) % LOCALBUS_DEDUPE_SIZE;
+
+		if (bus->recent[idx].hash != hash)
+			continue;
+		if (now - bus->recent[idx].stamp > LOCALBUS_DEDUPE_WINDOW)
+			continue;
+
+		bus->recent[idx].hash = 0;
+		return true;
+	}
+
+	return false;
+}
+
+static void *localbus_thread(void *data) {
+	struct localbus *bus = data;
+	struct mosquitto_message msg;
+	uint8_t buf[LOCALBUS_MAX_MSG + 1];
+	char topic[LOCALBUS_MAX_MSG];
+	size_t topiclen;
+	ssize_t len;
+
+	for (;;) {
+		len = recv(bus->fd, buf, LOCALBUS_MAX_MSG, 0);
+		if (len < 0) {
+			if (errno == EINTR)
+				continue;
+			fprintf(stderr, "localbus: receive failed: %s\n", strerror(errno));
+			return NULL;
+		}
+
+		if (len < LOCALBUS_HEADER || buf[0] != LOCALBUS_VERSION)
+			continue;
+
+		topiclen = (buf[2] << 8) | buf[3];
+		if (LOCALBUS_HEADER + topiclen > len)
+			continue;
+
+		memcpy(topic, buf + LOCALBUS_HEADER, topiclen);
+		topic[topiclen] = '\0';
+		if (!localbus_subscribed(bus, topic))
+			continue;
+
+		/* libmosquitto terminates payloads as well, handlers rely on it */
+		buf[len] = '\0';
+
+		memset(&msg, 0, sizeof(msg));
+		msg.topic = topic;
+		msg.payload = buf + LOCALBUS_HEADER + topiclen;
+		msg.payloadlen = len - LOCALBUS_HEADER - topiclen;
+		msg.retain = buf[1] & LOCALBUS_FLAG_RETAIN;
+
+		pthread_mutex_lock(&bus->lock);
+		localbus_remember(bus, localbus_hash(msg.topic, msg.payload, msg.payloadlen));
+		bus->cb(bus->mosq, bus->udata, &msg);
+		pthread_mutex_unlock(&bus->lock);
+	}
+
+	return NULL;
+}
+
+int localbus_start(struct localbus *bus) {
+	if (!localbus_enabled(bus) || !bus->path)
+		return 0;
+
+	return pthread_create(&bus->thread, NULL, localbus_thread, bus);
+}
+
+/* broker message path, skips copies of messages already delivered locally */
+void localbus_dispatch(struct localbus *bus, const struct mosquitto_message *msg) {
+	pthread_mutex_lock(&bus->lock);
+
+	if (!localbus_enabled(bus) || !localbus_subscribed(bus, msg->topic) ||
+	    !localbus_forget(bus, localbus_hash(msg->topic, msg->payload, msg->payloadlen)))
+		bus->cb(bus->mosq, bus->udata, msg);
+
+	pthread_mutex_unlock(&bus->lock);
+}
@@ -0,0 +1,69 @@
+#ifndef __LOCALBUS_H
+#define __LOCALBUS_H
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <pthread.h>
+#include <time.h>
+#include <sys/un.h>
+#include <mosquitto.h>
+
+/*
+ * Broker independent fast path for topics produced and consumed on the same
+ * host. Every subscriber binds a datagram socket in the bus directory,
+ * publishers send each message to all sockets found there. The broker still
+ * gets its copy, subscribers drop that copy again via localbus_dispatch().
+ *
+ * Only the live stream is mirrored: retained values of topics published
+ * before a subscriber started are still delivered by the broker.
+ */
+#define LOCALBUS_MAX_MSG 1024
+#define LOCALBUS_MAX_PEERS 16
+#define LOCALBUS_MAX_TOPICS 16
+
+/* broker copies arriving later than this are handled as new messages */
+#define LOCALBUS_DEDUPE_WINDOW (5 * 1000000000ULL)
+#define LOCALBUS_DEDUPE_SIZE 32
+
+typedef void (*localbus_cb)(struct mosquitto *m, void *udata, const struct mosquitto_message *msg);
+
+struct localbus_record {
+	uint32_t hash;
+	uint64_t stamp;
+};
+
+struct localbus {
+	int fd;
+	char *path;
+	char *dir;
+
+	/* message handler, calls from both paths are serialized by lock */
+	struct mosquitto *mosq;
+	void *udata;
+	localbus_cb cb;
+	pthread_mutex_t lock;
+	pthread_t thread;
+
+	char *topics[LOCALBUS_MAX_TOPICS];
+	int topic_count;
+
+	/* subscriber sockets, rescanned when the directory changes */
+	struct sockaddr_un peers[LOCALBUS_MAX_PEERS];
+	int peer_count;
+	struct timespec peer_mtime;
+	unsigned long dropped;
+
+	/* locally delivered messages, consumed by their broker copies */
+	struct localbus_record recent[LOCALBUS_DEDUPE_SIZE];
+	int recent_next;
+};
+
+void localbus_init(struct localbus *bus, struct mosquitto *mosq, void *udata, localbus_cb cb);
+int localbus_open(struct localbus *bus, const char *dir, const char *name);
+bool localbus_enabled(struct localbus *bus);
+int localbus_subscribe(struct localbus *bus, const char *topic);
+int localbus_start(struct localbus *bus);
+int localbus_publish(struct localbus *bus, const char *topic, int payloadlen, const void *payload, bool retain);
+void localbus_dispatch(struct localbus *bus, const struct mosquitto_message *msg);
+
+#endif
@@ -0,0 +1,270 @@
+/*
+ * Access Control System - MQTT session helpers
+ *
+ * Copyright (c) 2016, Sebastian Reichel <sre@mainframe.io>
+ *
+ * Permission to use, copy, modify, and/or distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY
+ * SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN ACTION
+ * OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF OR IN
+ * CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <signal.h>
+
+#include "mqtt.h"
+
+void mqtt_session_init(struct mqtt_session *s, struct mosquitto *mosq, unsigned int delay_min, unsigned int delay_max) {
+	memset(s, 0, sizeof(*s));
+	pthread_mutex_init(&s->lock, NULL);
+
+	s->mosq = mosq;
+	s->delay_min = delay_min ? delay_min : 1;
+	s->delay_max = (delay_max > s->delay_min) ? delay_max : s->delay_min;
+	s->seed = time(NULL) ^ getpid();
+}
+
+void mqtt_session_set_localbus(struct mqtt_session *s, struct localbus *local) {
+	s->local = local;
+}
+
+int mqtt_session_connect(struct mqtt_session *s, const char *host, int port, int keepalive) {
+	int ret = mosquitto_connect_async(s->mosq, host, port, keepalive);
+
+	switch (ret) {
+		case MOSQ_ERR_SUCCESS:
+			return 0;
+		case MOSQ_ERR_INVAL:
+		case MOSQ_ERR_NOMEM:
+			return ret;
+		default:
+			/* broker not reachable yet, the network loop keeps trying */
+			fprintf(stderr, "MQTT: initial connect failed (%s), retrying in background\n", mosquitto_strerror(ret));
+			return 0;
+	}
+}
+
+/*
+ * Some daemons publish from signal handlers (e.g. alarm based pulses), so
+ * signals are blocked while the session lock is held to avoid deadlocks.
+ */
+static void mqtt_lock(struct mqtt_session *s, sigset_t *old) {
+	sigset_t all;
+
+	sigfillset(&all);
+	pthread_sigmask(SIG_BLOCK, &all, old);
+	pthread_mutex_lock(&s->lock);
+}
+
+static void mqtt_unlock(struct mqtt_session *s, sigset_t *old) {
+	pthread_mutex_unlock(&s->lock);
+	pthread_sigmask(SIG_SETMASK, old, NULL);
+}
+
+/* exponential backoff with equal jitter: [delay/2, delay] */
+static unsigned int mqtt_backoff_delay(struct mqtt_session *s) {
+	unsigned int delay = s->delay_min;
+	unsigned int i;
+
+	for (i = 0; i < s->attempt && delay < s->delay_max; i++)
+		delay *= 2;
+	if (delay > s->delay_max)
+		delay = s->delay_max;
+
+	if (s->attempt < 32)
+		s->attempt++;
+
+	return delay / 2 + rand_r(&s->seed) % (delay / 2 + 1);
+}
+
+static void mqtt_queue_free(struct mqtt_queue_entry *e) {
+	free(e->topic);
+	free(e->payload);
+	e->topic = NULL;
+	e->payload = NULL;
+}
+
+/* called with s->lock held */
+static int mqtt_queue_push(struct mqtt_session *s, const char *topic, int payloadlen, const void *payload, int qos) {
+	struct mqtt_queue_entry *e = NULL;
+	void *copy;
+	int i;
+
+	copy = malloc(payloadlen ? payloadlen : 1);
+	if (!copy)
+		return MOSQ_ERR_NOMEM;
+	memcpy(copy, payload, payloadlen);
+
+	/* a newer retained value supersedes the queued one */
+	for (i = 0; i < s->queued; i++) {
+		if (!strcmp(s->queue[i].topic, topic)) {
+			e = &s->queue[i];
+			free(e->payload);
+			break;
+		}
+	}
+
+	if (!e) {
+		if (s->queued == MQTT_QUEUE_SIZE) {
+			fprintf(stderr, "MQTT: offline queue full, dropping %s\n", s->queue[0].topic);
+			mqtt_queue_free(&s->queue[0]);
+			memmove(&s->queue[0], &s->queue[1], (MQTT_QUEUE_SIZE - 1) * sizeof(s->queue[0]));
+			s->queued--;
+			s->dropped++;
+		}
+
+		e = &s->queue[s->queued];
+		e->topic = strdup(topic);
+		if (!e->topic) {
+			free(copy);
+			return MOSQ_ERR_NOMEM;
+		}
+		s->queued++;
+	}
+
+	e->payload = copy;
+	e->payloadlen = payloadlen;
+	e->qos = qos;
+
+	return MOSQ_ERR_SUCCESS;
+}
+
+/* called with s->lock held */
+static void mqtt_queue_flush(struct mqtt_session *s) {
+	int i, ret;
+
+	for (i = 0; i < s->queued; i++) {
+		struct mqtt_queue_entry *e = &s->queue[i];
+
+		ret = mosquitto_publish(s->mosq, NULL, e->topic, e->payloadlen, e->payload, e->qos, true);
+		if (ret) {
+			fprintf(stderr, "MQTT: could not flush %s: %d\n", e->topic, ret);
+			break;
+		}
+
+		mqtt_queue_free(e);
+	}
+
+	/* keep whatever could not be sent for the next connection */
+	memmove(&s->queue[0], &s->queue[i], (s->queued - i) * sizeof(s->queue[0]));
+	s->queued -= i;
+
+	if (i)
+		fprintf(stderr, "MQTT: flushed %d queued messages\n", i);
+}
+
+void mqtt_session_connected(struct mqtt_session *s, int res) {
+	sigset_t old;
+
+	if (res)
+		return;
+
+	mqtt_lock(s, &old);
+	s->connected = true;
+	s->attempt = 0;
+	mqtt_queue_flush(s);
+	mqtt_unlock(s, &old);
+}
+
+void mqtt_session_disconnected(struct mqtt_session *s, int res) {
+	sigset_t old;
+
+	mqtt_lock(s, &old);
+	s->connected = false;
+	mqtt_unlock(s, &old);
+}
+
+int mqtt_session_loop_forever(struct mqtt_session *s) {
+	unsigned int delay;
+	int ret;
+
+	while (!s->stop) {
+		ret = mosquitto_loop(s->mosq, MQTT_LOOP_TIMEOUT, 1);
+		if (ret == MOSQ_ERR_SUCCESS)
+			continue;
+
+		if (ret == MOSQ_ERR_INVAL || ret == MOSQ_ERR_NOMEM)
+			return ret;
+
+		if (s->stop)
+			break;
+
+		delay = mqtt_backoff_delay(s);
+		fprintf(stderr, "MQTT: connection lost (%s), reconnecting in %u ms\n", mosquitto_strerror(ret), delay);
+		usleep(delay * 1000);
+
+		ret = mosquitto_reconnect_async(s->mosq);
+		if (ret)
+			fprintf(stderr, "MQTT: reconnect failed: %s\n", mosquitto_strerror(ret));
+	}
+
+	return 0;
+}
+
+static void *mqtt_session_thread(void *data) {
+	struct mqtt_session *s = data;
+	int ret = mqtt_session_loop_forever(s);
+
+	if (ret)
+		fprintf(stderr, "MQTT: network loop terminated: %d\n", ret);
+
+	return NULL;
+}
+
+int mqtt_session_loop_start(struct mqtt_session *s) {
+	mosquitto_threaded_set(s->mosq, true);
+	return pthread_create(&s->thread, NULL, mqtt_session_thread, s);
+}
+
+void mqtt_session_loop_stop(struct mqtt_session *s) {
+	s->stop = true;
+	pthread_join(s->thread, NULL);
+}
+
+int mqtt_publish_retained(struct mqtt_session *s, const char *topic, int payloadlen, const void *payload, int qos) {
+	int ret = MOSQ_ERR_NO_CONN;
+	sigset_t old;
+
+	mqtt_lock(s, &old);
+
+	if (s->local)
+		localbus_publish(s->local, topic, payloadlen, payload, true);
+
+	if (s->connected)
+		ret = mosquitto_publish(s->mosq, NULL, topic, payloadlen, payload, qos, true);
+
+	if (ret == MOSQ_ERR_NO_CONN || ret == MOSQ_ERR_CONN_LOST)
+		ret = mqtt_queue_push(s, topic, payloadlen, payload, qos);
+
+	mqtt_unlock(s, &old);
+
+	return ret;
+}
+
+/* not queued while offline, a late copy would be meaningless */
+int mqtt_publish_volatile(struct mqtt_session *s, const char *topic, int payloadlen, const void *payload, int qos) {
+	int ret;
+	sigset_t old;
+
+	mqtt_lock(s, &old);
+
+	if (s->local)
+		localbus_publish(s->local, topic, payloadlen, payload, false);
+
+	ret = mosquitto_publish(s->mosq, NULL, topic, payloadlen, payload, qos, false);
+
+	mqtt_unlock(s, &old);
+
+	return ret;
+}
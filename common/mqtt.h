@@ -0,0 +1,58 @@
+#ifndef __MQTT_H
+#define __MQTT_H
+
+#include <stdbool.h>
+#include <pthread.h>
+#include <mosquitto.h>
+#include "localbus.h"
+
+/* maximum number of distinct topics held back while offline */
+#define MQTT_QUEUE_SIZE 32
+
+/* timeout for a single network loop iteration in ms */
+#define MQTT_LOOP_TIMEOUT 1000
+
+struct mqtt_queue_entry {
+	char *topic;
+	void *payload;
+	int payloadlen;
+	int qos;
+};
+
+struct mqtt_session {
+	struct mosquitto *mosq;
+	struct localbus *local;
+	pthread_mutex_t lock;
+	pthread_t thread;
+	bool connected;
+	bool stop;
+
+	/* reconnect policy (delays in ms) */
+	unsigned int delay_min;
+	unsigned int delay_max;
+	unsigned int attempt;
+	unsigned int seed;
+
+	/* retained publishes waiting for the broker, one entry per topic */
+	struct mqtt_queue_entry queue[MQTT_QUEUE_SIZE];
+	int queued;
+	unsigned long dropped;
+};
+
+void mqtt_session_init(struct mqtt_session *s, struct mosquitto *mosq, unsigned int delay_min, unsigned int delay_max);
+void mqtt_session_set_localbus(struct mqtt_session *s, struct localbus *local);
+int mqtt_session_connect(struct mqtt_session *s, const char *host, int port, int keepalive);
+
+/* must be called from the on_connect and on_disconnect callbacks */
+void mqtt_session_connected(struct mqtt_session *s, int res);
+void mqtt_session_disconnected(struct mqtt_session *s, int res);
+
+int mqtt_session_loop_forever(struct mqtt_session *s);
+int mqtt_session_loop_start(struct mqtt_session *s);
+void mqtt_session_loop_stop(struct mqtt_session *s);
+
+/* both also deliver to the local bus (if any) before handing over to the broker */
+int mqtt_publish_retained(struct mqtt_session *s, const char *topic, int payloadlen, const void *payload, int qos);
+int mqtt_publish_volatile(struct mqtt_session *s, const char *topic, int payloadlen, const void *payload, int qos);
+
+#endif
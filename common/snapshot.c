@@ -0,0 +1,126 @@
+/*
+ * Access Control System - Aggregated space state
+ *
+ * Copyright (c) 2016, Sebastian Reichel <sre@mainframe.io>
+ *
+ * Permission to use, copy, modify, and/or distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY
+ * SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN ACTION
+ * OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF OR IN
+ * CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+
+#include "state.h"
+#include "snapshot.h"
+
+/*
+ * Sequence numbers start at the current time, so a restarted publisher
+ * continues above the value still retained by the broker.
+ */
+uint32_t snapshot_seq_init() {
+	return time(NULL);
+}
+
+void snapshot_set(struct snapshot *s, int keyholder_id, const char *name, const char *state, const char *next, const char *message) {
+	s->keyholder_id = keyholder_id;
+	s->state = str2state(state);
+	s->next = str2state(next);
+	snprintf(s->name, sizeof(s->name), "%s", name ? name : "");
+	snprintf(s->message, sizeof(s->message), "%s", message ? message : "");
+}
+
+static void put32(uint8_t *buf, uint32_t val) {
+	buf[0] = val >> 24;
+	buf[1] = val >> 16;
+	buf[2] = val >> 8;
+	buf[3] = val;
+}
+
+static uint32_t get32(const uint8_t *buf) {
+	return ((uint32_t) buf[0] << 24) | (buf[1] << 16) | (buf[2] << 8) | buf[3];
+}
+
+int snapshot_pack(const struct snapshot *s, uint8_t *buf, size_t len) {
+	size_t namelen = strlen(s->name);
+	size_t msglen = strlen(s->message);
+	size_t size = 15 + namelen + msglen;
+	uint8_t *p = buf;
+
+	if (len < size)
+		return -1;
+
+	*p++ = SNAPSHOT_VERSION;
+	*p++ = s->source;
+	put32(p, s->seq);
+	p += 4;
+	put32(p, s->keyholder_id);
+	p += 4;
+	*p++ = s->state;
+	*p++ = s->next;
+
+	*p++ = namelen;
+	memcpy(p, s->name, namelen);
+	p += namelen;
+
+	*p++ = msglen >> 8;
+	*p++ = msglen & 0xff;
+	memcpy(p, s->message, msglen);
+
+	return size;
+}
+
+bool snapshot_unpack(struct snapshot *s, const void *data, size_t len) {
+	const uint8_t *buf = data;
+	const uint8_t *end = buf + len;
+	size_t namelen, msglen;
+
+	if (len < 15 || buf[0] != SNAPSHOT_VERSION)
+		return false;
+
+	s->source = buf[1];
+	s->seq = get32(buf + 2);
+	s->keyholder_id = get32(buf + 6);
+	s->state = buf[10];
+	s->next = buf[11];
+	if (s->state >= STATE_MAX || s->next >= STATE_MAX)
+		return false;
+
+	namelen = buf[12];
+	buf += 13;
+	if (buf + namelen + 2 > end)
+		return false;
+	memcpy(s->name, buf, namelen);
+	s->name[namelen] = '\0';
+	buf += namelen;
+
+	msglen = (buf[0] << 8) | buf[1];
+	buf += 2;
+	if (msglen > SNAPSHOT_MESSAGE_MAX || buf + msglen > end)
+		return false;
+	memcpy(s->message, buf, msglen);
+	s->message[msglen] = '\0';
+
+	return true;
+}
+
+/* retained copies are redelivered on every reconnect, skip those */
+bool snapshot_is_newer(const struct snapshot *last, const struct snapshot *s) {
+	if (last->source != s->source)
+		return true;
+
+	return (int32_t) (s->seq - last->seq) > 0;
+}
+
+const char *snapshot_state_str(uint8_t state) {
+	return state2str(state);
+}
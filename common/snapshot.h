@@ -0,0 +1,48 @@
+#ifndef __SNAPSHOT_H
+#define __SNAPSHOT_H
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <stddef.h>
+
+/*
+ * Aggregated space state, published retained on SNAPSHOT_TOPIC next to the
+ * per-field topics. One message carries the complete state, so subscribers
+ * never see a half updated combination of state, next state and keyholder.
+ *
+ * [version] [source] [seq:32] [keyholder id:32] [state] [next state]
+ * [name len] [name...] [message len:16] [message...]    (big endian)
+ *
+ * state and next state are enum state values from common/state.h, an unset
+ * next state is STATE_UNKNOWN.
+ */
+#define SNAPSHOT_TOPIC "/access-control-system/space-state-snapshot"
+#define SNAPSHOT_VERSION 1
+#define SNAPSHOT_NAME_MAX 255
+#define SNAPSHOT_MESSAGE_MAX 1023
+#define SNAPSHOT_MAX_SIZE (15 + SNAPSHOT_NAME_MAX + SNAPSHOT_MESSAGE_MAX)
+
+enum snapshot_source {
+	SNAPSHOT_SOURCE_UNKNOWN = 0,
+	SNAPSHOT_SOURCE_KEYHOLDER,
+	SNAPSHOT_SOURCE_SWITCH,
+};
+
+struct snapshot {
+	uint8_t source;
+	uint32_t seq;
+	int32_t keyholder_id;
+	uint8_t state;
+	uint8_t next;
+	char name[SNAPSHOT_NAME_MAX+1];
+	char message[SNAPSHOT_MESSAGE_MAX+1];
+};
+
+uint32_t snapshot_seq_init();
+void snapshot_set(struct snapshot *s, int keyholder_id, const char *name, const char *state, const char *next, const char *message);
+int snapshot_pack(const struct snapshot *s, uint8_t *buf, size_t len);
+bool snapshot_unpack(struct snapshot *s, const void *buf, size_t len);
+bool snapshot_is_newer(const struct snapshot *last, const struct snapshot *s);
+const char *snapshot_state_str(uint8_t state);
+
+#endif
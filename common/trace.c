@@ -0,0 +1,106 @@
+/*
+ * Access Control System - Event latency tracing
+ *
+ * Copyright (c) 2016, Sebastian Reichel <sre@mainframe.io>
+ *
+ * Permission to use, copy, modify, and/or distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY
+ * SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN ACTION
+ * OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF OR IN
+ * CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "trace.h"
+
+uint64_t trace_now() {
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t) ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+void trace_start(struct trace *t, uint16_t seq, uint64_t edge) {
+	memset(t, 0, sizeof(*t));
+	t->seq = seq;
+	t->stamp[0] = edge;
+	t->hops = 1;
+	trace_hop(t);
+}
+
+bool trace_hop(struct trace *t) {
+	if (t->hops >= TRACE_MAX_HOPS)
+		return false;
+
+	t->stamp[t->hops++] = trace_now();
+	return true;
+}
+
+bool trace_fresh(const struct trace *t) {
+	if (!t->hops)
+		return false;
+
+	return trace_now() - t->stamp[t->hops - 1] < TRACE_MAX_AGE;
+}
+
+/* [version] [hops] [seq:16] [stamp:64]... (big endian) */
+int trace_pack(const struct trace *t, uint8_t *buf, size_t len) {
+	size_t size = 4 + 8 * t->hops;
+	int i, j;
+
+	if (len < size)
+		return -1;
+
+	buf[0] = TRACE_VERSION;
+	buf[1] = t->hops;
+	buf[2] = t->seq >> 8;
+	buf[3] = t->seq & 0xff;
+
+	for (i = 0; i < t->hops; i++)
+		for (j = 0; j < 8; j++)
+			buf[4 + 8*i + j] = t->stamp[i] >> (56 - 8*j);
+
+	return size;
+}
+
+bool trace_unpack(struct trace *t, const void *data, size_t len) {
+	const uint8_t *buf = data;
+	int i, j;
+
+	if (len < 4 || buf[0] != TRACE_VERSION)
+		return false;
+
+	t->hops = buf[1];
+	t->seq = (buf[2] << 8) | buf[3];
+
+	if (t->hops > TRACE_MAX_HOPS || len < 4 + 8 * (size_t) t->hops)
+		return false;
+
+	for (i = 0; i < t->hops; i++) {
+		t->stamp[i] = 0;
+		for (j = 0; j < 8; j++)
+			t->stamp[i] = (t->stamp[i] << 8) | buf[4 + 8*i + j];
+	}
+
+	return true;
+}
+
+char *trace_topic(const char *topic) {
+	size_t len = strlen(topic) + strlen(TRACE_SUFFIX) + 1;
+	char *result = malloc(len);
+
+	if (result)
+		snprintf(result, len, "%s%s", topic, TRACE_SUFFIX);
+
+	return result;
+}
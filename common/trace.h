@@ -0,0 +1,37 @@
+#ifndef __TRACE_H
+#define __TRACE_H
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <stddef.h>
+
+/*
+ * Latency trace envelope, published on "<topic>" TRACE_SUFFIX right before
+ * the message it describes. stamp[0] is the kernel timestamp of the GPIO
+ * edge, every daemon forwarding the event appends its own stamp. All stamps
+ * are CLOCK_MONOTONIC nanoseconds, so the hops must run on the same host
+ * (and a kernel >= 5.7, older kernels report edges in CLOCK_REALTIME).
+ */
+#define TRACE_SUFFIX "/trace"
+#define TRACE_VERSION 1
+#define TRACE_MAX_HOPS 8
+#define TRACE_MAX_SIZE (4 + 8 * TRACE_MAX_HOPS)
+
+/* traces older than this are not attached to a new event */
+#define TRACE_MAX_AGE (2 * 1000000000ULL)
+
+struct trace {
+	uint16_t seq;
+	uint8_t hops;
+	uint64_t stamp[TRACE_MAX_HOPS];
+};
+
+uint64_t trace_now();
+void trace_start(struct trace *t, uint16_t seq, uint64_t edge);
+bool trace_hop(struct trace *t);
+bool trace_fresh(const struct trace *t);
+int trace_pack(const struct trace *t, uint8_t *buf, size_t len);
+bool trace_unpack(struct trace *t, const void *buf, size_t len);
+char *trace_topic(const char *topic);
+
+#endif
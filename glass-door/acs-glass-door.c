@@ -24,11 +24,19 @@
 #include <stdlib.h>
 #include <signal.h>
 #include "../common/config.h"
+#include "../common/mqtt.h"
+#include "../common/localbus.h"
+#include "../common/trace.h"
 
 #define TOPIC_BELL "/access-control-system/bell"
 #define TOPIC_BUZZER "/access-control-system/glass-door/buzzer"
+
+/* acs-gpio-actor switches the output off again on its own */
+#define PULSE_BUZZER "pulse:3000"
+#define PULSE_BELL "pulse:1000"
 #define TOPIC_STATE "/access-control-system/space-state"
 #define TOPIC_BELL_BUTTON "/access-control-system/glass-door/bell-button"
+#define TOPIC_BELL_BUTTON_TRACE TOPIC_BELL_BUTTON TRACE_SUFFIX
 
 const static char* states[] = {
 	"unknown",
@@ -58,17 +66,23 @@ struct userdata {
 	bool eventinprogress;
 	int buzzer;
 	int bell;
-	int timer;
+
+	/* latency trace of the last bell button edge */
+	struct trace trace;
 };
 
 #define GPIO_TIMEOUT 60 * 1000
 
 struct userdata *globaludata;
 
+static struct mqtt_session session;
+static struct localbus local;
+
 static void on_connect(struct mosquitto *m, void *udata, int res) {
 	int ret;
 
 	fprintf(stderr, "Connected.\n");
+	mqtt_session_connected(&session, res);
 
 	ret = mosquitto_subscribe(m, NULL, TOPIC_STATE, 1);
 	if (ret) {
@@ -81,11 +95,19 @@ static void on_connect(struct mosquitto *m, void *udata, int res) {
 		fprintf(stderr, "MQTT Error: Could not subscribe to %s: %d\n", TOPIC_STATE, ret);
 		exit(1);
 	}
+
+	ret = mosquitto_subscribe(m, NULL, TOPIC_BELL_BUTTON_TRACE, 0);
+	if (ret) {
+		fprintf(stderr, "MQTT Error: Could not subscribe to %s: %d\n", TOPIC_BELL_BUTTON_TRACE, ret);
+		exit(1);
+	}
 }
 
 static void on_disconnect(struct mosquitto *m, void *data, int res) {
 	struct userdata *udata = (struct userdata*) data;
 
+	mqtt_session_disconnected(&session, res);
+
 	/* ignore repeated events */
 	if(udata->state == STATE_DISCONNECTED)
 		return;
@@ -139,6 +161,29 @@ static void on_state_message(struct mosquitto *m, void *data, const struct mosqu
 	udata->state = curstate;
 }
 
+static void on_trace_message(struct mosquitto *m, void *data, const struct mosquitto_message *msg) {
+	struct userdata *udata = (struct userdata*) data;
+
+	if (!trace_unpack(&udata->trace, msg->payload, msg->payloadlen))
+		udata->trace.hops = 0;
+}
+
+/* forward the bell button trace with our own stamp, must precede the action */
+static void forward_trace(struct mosquitto *m, struct userdata *udata, bool buzzer, bool bell) {
+	uint8_t buf[TRACE_MAX_SIZE];
+	int len;
+
+	if (trace_fresh(&udata->trace) && trace_hop(&udata->trace)) {
+		len = trace_pack(&udata->trace, buf, sizeof(buf));
+		if (buzzer)
+			mqtt_publish_volatile(&session, TOPIC_BUZZER TRACE_SUFFIX, len, buf, 0);
+		if (bell)
+			mqtt_publish_volatile(&session, TOPIC_BELL TRACE_SUFFIX, len, buf, 0);
+	}
+
+	udata->trace.hops = 0;
+}
+
 static void on_button_message(struct mosquitto *m, void *data, const struct mosquitto_message *msg) {
 	struct userdata *udata = (struct userdata*) data;
 
@@ -155,28 +200,30 @@ static void on_button_message(struct mosquitto *m, void *data, const struct mosq
 	}
 
 	udata->eventinprogress = true;
-	udata->timer = 0;
 
 	switch(udata->state) {
 		case STATE_OPEN_PLUS:
-			mosquitto_publish(m, NULL, TOPIC_BUZZER, 2, "1", 0, true);
+			forward_trace(m, udata, true, false);
+			mqtt_publish_volatile(&session, TOPIC_BUZZER, sizeof(PULSE_BUZZER), PULSE_BUZZER, 0);
 			alarm(3);
 			break;
 		case STATE_OPEN:
-			mosquitto_publish(m, NULL, TOPIC_BUZZER, 2, "1", 0, true);
+			forward_trace(m, udata, true, false);
+			mqtt_publish_volatile(&session, TOPIC_BUZZER, sizeof(PULSE_BUZZER), PULSE_BUZZER, 0);
 			alarm(3);
 			break;
 		case STATE_MEMBER:
 		case STATE_KEYHOLDER:
-			mosquitto_publish(m, NULL, TOPIC_BUZZER, 2, "1", 0, true);
-			mosquitto_publish(m, NULL, TOPIC_BELL, 2, "1", 0, true);
-			udata->timer = 2;
-			alarm(1);
+			forward_trace(m, udata, true, true);
+			mqtt_publish_volatile(&session, TOPIC_BUZZER, sizeof(PULSE_BUZZER), PULSE_BUZZER, 0);
+			mqtt_publish_volatile(&session, TOPIC_BELL, sizeof(PULSE_BELL), PULSE_BELL, 0);
+			alarm(3);
 			break;
 		case STATE_NONE:
 		case STATE_UNKNOWN:
 		case STATE_DISCONNECTED:
-			mosquitto_publish(m, NULL, TOPIC_BELL, 2, "1", 0, true);
+			forward_trace(m, udata, false, true);
+			mqtt_publish_volatile(&session, TOPIC_BELL, sizeof(PULSE_BELL), PULSE_BELL, 0);
 			alarm(1);
 			break;
 	}
@@ -195,26 +242,26 @@ static void on_message(struct mosquitto *m, void *data, const struct mosquitto_m
 		return;
 	}
 
+	/* latency trace of the bell button */
+	if(!strcmp(TOPIC_BELL_BUTTON_TRACE, msg->topic)) {
+		on_trace_message(m, data, msg);
+		return;
+	}
+
 	fprintf(stderr, "Ignored message with wrong topic\n");
 	return;
 }
 
+/* the pulses are over, accept the next button press */
 void on_alarm(int signal) {
 	printf("alarm!\n");
-	mosquitto_publish(globaludata->mosq, NULL, TOPIC_BELL, 2, "0", 0, true);
-
-	if (globaludata->timer) {
-		int tmp = globaludata->timer;
-		globaludata->timer = 0;
-		alarm(tmp);
-		return;
-	}
-
-	/* disable buzzer and bell */
-	mosquitto_publish(globaludata->mosq, NULL, TOPIC_BUZZER, 2, "0", 0, true);
 	globaludata->eventinprogress = false;
 }
 
+static void on_broker_message(struct mosquitto *m, void *data, const struct mosquitto_message *msg) {
+	localbus_dispatch(&local, msg);
+}
+
 int main(int argc, char **argv) {
 	struct mosquitto *mosq;
 	struct userdata udata;
@@ -230,6 +277,9 @@ int main(int argc, char **argv) {
 	char *host = cfg_get_default(cfg, "mqtt-broker-host", MQTT_BROKER_HOST);
 	int port = cfg_get_int_default(cfg, "mqtt-broker-port", MQTT_BROKER_PORT);
 	int keepalv = cfg_get_int_default(cfg, "mqtt-keepalive", MQTT_KEEPALIVE_SECONDS);
+	int delay_min = cfg_get_int_default(cfg, "mqtt-reconnect-delay-min", MQTT_RECONNECT_DELAY_MIN);
+	int delay_max = cfg_get_int_default(cfg, "mqtt-reconnect-delay-max", MQTT_RECONNECT_DELAY_MAX);
+	char *localdir = cfg_get_default(cfg, "localbus-dir", LOCALBUS_DIR);
 	cfg_close(cfg);
 
 	/* create mosquitto client instance */
@@ -246,7 +296,7 @@ int main(int argc, char **argv) {
 	mosquitto_disconnect_callback_set(mosq, on_disconnect);
 	mosquitto_subscribe_callback_set(mosq, on_subscribe);
 	mosquitto_log_callback_set(mosq, on_log);
-	mosquitto_message_callback_set(mosq, on_message);
+	mosquitto_message_callback_set(mosq, on_broker_message);
 
 	/* setup credentials */
 	if (strcmp(user, "")) {
@@ -272,7 +322,8 @@ int main(int argc, char **argv) {
 	}
 
 	/* connect to broker */
-	ret = mosquitto_connect(mosq, host, port, keepalv);
+	mqtt_session_init(&session, mosq, delay_min, delay_max);
+	ret = mqtt_session_connect(&session, host, port, keepalv);
 	if (ret) {
 		fprintf(stderr, "Error could not connect to broker: %d\n", ret);
 		return 1;
@@ -280,11 +331,25 @@ int main(int argc, char **argv) {
 
 	/* init udata */
 	udata.eventinprogress = false;
+	udata.trace.hops = 0;
 
 	globaludata = &udata;
 	signal(SIGALRM, on_alarm);
 
-	ret = mosquitto_loop_forever(mosq, -1, 1);
+	/* on-device topics bypass the broker */
+	localbus_init(&local, mosq, &udata, on_message);
+	ret = localbus_open(&local, localdir, "glass-door");
+	if (!ret) {
+		ret |= localbus_subscribe(&local, TOPIC_BELL_BUTTON);
+		ret |= localbus_subscribe(&local, TOPIC_BELL_BUTTON_TRACE);
+		ret |= localbus_start(&local);
+	}
+	if (ret)
+		fprintf(stderr, "Local bus disabled: %d\n", ret);
+	else
+		mqtt_session_set_localbus(&session, &local);
+
+	ret = mqtt_session_loop_forever(&session);
 	if (ret) {
 		fprintf(stderr, "Error could not setup mosquitto network loop: %d\n", ret);
 		return 1;
@@ -34,53 +34,249 @@
 #include <poll.h>
 #include <mosquitto.h>
 #include <stdlib.h>
+#include <pthread.h>
+#include <sys/timerfd.h>
 #include "../keyboard/gpio.h"
 #include "../common/config.h"
+#include "../common/mqtt.h"
+#include "../common/localbus.h"
+#include "../common/trace.h"
+#include "../common/histogram.h"
+
+#define TOPIC_LATENCY "/access-control-system/gpio-actor/latency"
+#define TOPIC_LATENCY_DUMP TOPIC_LATENCY "/dump"
+
+#define PULSE_PREFIX "pulse:"
+
+/* "0" on "<topic>" DONE_SUFFIX when an output was switched off by its timer */
+#define DONE_SUFFIX "/done"
 
 struct mqttgpio {
 	char *topic;
 	struct gpiodesc desc;
+
+	/* longest on-time (ms), also ends a "1" whose "0" got lost */
+	unsigned int max_on;
+
+	/* private */
+	char *trace_topic;
+	char *done_topic;
+	struct trace trace;
+	int timerfd;
+	bool on;
 };
 
 struct mqttgpio gpios[] = {
-	{"/access-control-system/main-door/buzzer",		{ "i2c/1-0021", 0, "maindoor buzzer", true, true, -1, -1 }},
-	{"/access-control-system/glass-door/buzzer",	{ "i2c/1-0022", 4, "glassdoor buzzer", true, true, -1, -1 }},
-	{"/access-control-system/bell",					{ "i2c/1-0022", 0, "bell", true, true, -1, -1 }},
+	{"/access-control-system/main-door/buzzer",		{ "i2c/1-0021", 0, "maindoor buzzer", true, true, -1, -1 }, 10000},
+	{"/access-control-system/glass-door/buzzer",	{ "i2c/1-0022", 4, "glassdoor buzzer", true, true, -1, -1 }, 10000},
+	{"/access-control-system/bell",					{ "i2c/1-0022", 0, "bell", true, true, -1, -1 }, 5000},
 	{}
 };
 
+static struct mqtt_session session;
+static struct localbus local;
+
+/* message handlers and the pulse timer thread both switch outputs */
+static pthread_mutex_t gpio_lock = PTHREAD_MUTEX_INITIALIZER;
+
+/* latency[0] is edge to output, latency[i] the time spent in hop i (µs) */
+static struct histogram latency[TRACE_MAX_HOPS];
+static const char *latency_names[TRACE_MAX_HOPS] = {
+	"total", "hop1", "hop2", "hop3", "hop4", "hop5", "hop6", "hop7",
+};
+
 static void on_connect(struct mosquitto *m, void *udata, int res) {
+	int i, err;
+
 	fprintf(stderr, "MQTT connected.\n");
+	mqtt_session_connected(&session, res);
+
+	/* subscribe (again, the session is not persistent) */
+	for (i = 0; gpios[i].desc.dev; i++) {
+		err = mosquitto_subscribe(m, NULL, gpios[i].topic, 1);
+		if (err) {
+			fprintf(stderr, "could not subscribe to mqtt \"%s\": %d!\n", gpios[i].topic, err);
+			exit(1);
+		}
+
+		err = mosquitto_subscribe(m, NULL, gpios[i].trace_topic, 0);
+		if (err) {
+			fprintf(stderr, "could not subscribe to mqtt \"%s\": %d!\n", gpios[i].trace_topic, err);
+			exit(1);
+		}
+	}
+
+	err = mosquitto_subscribe(m, NULL, TOPIC_LATENCY_DUMP, 0);
+	if (err) {
+		fprintf(stderr, "could not subscribe to mqtt \"%s\": %d!\n", TOPIC_LATENCY_DUMP, err);
+		exit(1);
+	}
 }
 
 static void on_disconnect(struct mosquitto *m, void *udata, int res) {
 	fprintf(stderr, "MQTT disconnected.\n");
-	exit(1);
+	mqtt_session_disconnected(&session, res);
+}
+
+/* close the trace of the event that caused the output change */
+static void latency_record(struct trace *t) {
+	int i;
+
+	if (trace_fresh(t) && trace_hop(t)) {
+		histogram_record(&latency[0], (t->stamp[t->hops-1] - t->stamp[0]) / 1000);
+		for (i = 1; i < t->hops; i++)
+			histogram_record(&latency[i], (t->stamp[i] - t->stamp[i-1]) / 1000);
+	}
+
+	t->hops = 0;
+}
+
+/* payload "reset" clears the histograms after reporting them */
+static void latency_dump(struct mosquitto *m, const struct mosquitto_message *msg) {
+	char report[1024];
+	size_t len = 0;
+	int i;
+
+	for (i = 0; i < TRACE_MAX_HOPS && len < sizeof(report); i++) {
+		if (i && !latency[i].count)
+			continue;
+		len += histogram_format(&latency[i], report + len, sizeof(report) - len);
+	}
+
+	if (len >= sizeof(report))
+		len = sizeof(report) - 1;
+
+	fprintf(stderr, "%s", report);
+	mosquitto_publish(m, NULL, TOPIC_LATENCY, len, report, 0, false);
+
+	if (msg->payloadlen == 5 && !strncmp(msg->payload, "reset", 5))
+		for (i = 0; i < TRACE_MAX_HOPS; i++)
+			histogram_reset(&latency[i]);
+}
+
+/* called with gpio_lock held, a zero time disarms the timer */
+static void pulse_arm(struct mqttgpio *gpio, unsigned int ms) {
+	struct itimerspec its = {
+		.it_value = {
+			.tv_sec = ms / 1000,
+			.tv_nsec = (ms % 1000) * 1000000L,
+		},
+	};
+
+	if (timerfd_settime(gpio->timerfd, 0, &its, NULL))
+		fprintf(stderr, "could not arm timer of %s: %d\n", gpio->desc.name, errno);
+}
+
+/* "1", "0" or "pulse:<ms>" */
+static void gpio_command(struct mqttgpio *gpio, const struct mosquitto_message *msg) {
+	const char *payload = msg->payload;
+	unsigned int ms = gpio->max_on;
+	bool val;
+
+	if (msg->payloadlen > strlen(PULSE_PREFIX) && !strncmp(payload, PULSE_PREFIX, strlen(PULSE_PREFIX))) {
+		ms = strtoul(payload + strlen(PULSE_PREFIX), NULL, 10);
+		if (!ms || ms > gpio->max_on)
+			ms = gpio->max_on;
+		val = true;
+	} else {
+		val = (msg->payloadlen == 0 || payload[0] == '0') ? false : true;
+	}
+
+	pthread_mutex_lock(&gpio_lock);
+
+	if (val)
+		fprintf(stderr, "Set GPIO %s: %d (off in %u ms)\n", gpio->desc.name, val, ms);
+	else
+		fprintf(stderr, "Set GPIO %s: %d\n", gpio->desc.name, val);
+
+	gpio_write(&gpio->desc, val);
+	pulse_arm(gpio, val ? ms : 0);
+	gpio->on = val;
+	latency_record(&gpio->trace);
+
+	pthread_mutex_unlock(&gpio_lock);
+}
+
+/*
+ * Switches outputs off when their pulse (or maximum on-time) is over and
+ * reports it on the done topic. A command that arrived after the timer
+ * fired re-armed or disarmed it, which is checked under the lock.
+ */
+static void *pulse_thread(void *data) {
+	struct pollfd fds[8];
+	struct itimerspec its;
+	uint64_t expirations;
+	int i, n, ret;
+
+	for (n = 0; gpios[n].desc.dev && n < 8; n++) {
+		fds[n].fd = gpios[n].timerfd;
+		fds[n].events = POLLIN;
+	}
+
+	for (;;) {
+		ret = poll(fds, n, -1);
+		if (ret < 0) {
+			if (errno == EINTR)
+				continue;
+			fprintf(stderr, "failed to poll pulse timers: %d\n", errno);
+			exit(1);
+		}
+
+		for (i = 0; i < n; i++) {
+			if (!(fds[i].revents & POLLIN))
+				continue;
+			if (read(gpios[i].timerfd, &expirations, sizeof(expirations)) < 0)
+				continue;
+
+			pthread_mutex_lock(&gpio_lock);
+			if (gpios[i].on && !timerfd_gettime(gpios[i].timerfd, &its) &&
+			    !its.it_value.tv_sec && !its.it_value.tv_nsec) {
+				fprintf(stderr, "Set GPIO %s: 0 (pulse done)\n", gpios[i].desc.name);
+				gpio_write(&gpios[i].desc, 0);
+				gpios[i].on = false;
+				mqtt_publish_volatile(&session, gpios[i].done_topic, 1, "0", 0);
+			}
+			pthread_mutex_unlock(&gpio_lock);
+		}
+	}
+
+	return NULL;
 }
 
 static void on_message(struct mosquitto *m, void *udata, const struct mosquitto_message *msg) {
 	int i;
 
+	if (!strcmp(TOPIC_LATENCY_DUMP, msg->topic)) {
+		latency_dump(m, msg);
+		return;
+	}
+
 	for (i = 0; gpios[i].desc.dev; i++) {
+		if (!strcmp(gpios[i].trace_topic, msg->topic)) {
+			if (!trace_unpack(&gpios[i].trace, msg->payload, msg->payloadlen))
+				gpios[i].trace.hops = 0;
+			break;
+		}
+
 		if(strcmp(gpios[i].topic, msg->topic))
 			continue;
 
-		bool val = (msg->payloadlen == 0 || ((char*) msg->payload)[0] == '0') ? false : true;
-
-		fprintf(stderr, "Set GPIO %s: %d\n", gpios[i].desc.name, val);
-		gpio_write(&gpios[i].desc, val);
-
+		gpio_command(&gpios[i], msg);
 		break;
 	}
 }
 
+static void on_broker_message(struct mosquitto *m, void *udata, const struct mosquitto_message *msg) {
+	localbus_dispatch(&local, msg);
+}
+
 static void on_log(struct mosquitto *m, void *udata, int level, const char *str) {
 	fprintf(stdout, "[%d] %s\n", level, str);
 }
 
 struct mosquitto* mqtt_init() {
 	struct mosquitto *mosq;
-	int ret;
+	int i, ret;
 
 	mosquitto_lib_init();
 
@@ -91,6 +287,9 @@ struct mosquitto* mqtt_init() {
 	char *host = cfg_get_default(cfg, "mqtt-broker-host", MQTT_BROKER_HOST);
 	int port = cfg_get_int_default(cfg, "mqtt-broker-port", MQTT_BROKER_PORT);
 	int keepalv = cfg_get_int_default(cfg, "mqtt-keepalive", MQTT_KEEPALIVE_SECONDS);
+	int delay_min = cfg_get_int_default(cfg, "mqtt-reconnect-delay-min", MQTT_RECONNECT_DELAY_MIN);
+	int delay_max = cfg_get_int_default(cfg, "mqtt-reconnect-delay-max", MQTT_RECONNECT_DELAY_MAX);
+	char *localdir = cfg_get_default(cfg, "localbus-dir", LOCALBUS_DIR);
 	cfg_close(cfg);
 
 	/* create mosquitto client instance */
@@ -103,7 +302,7 @@ struct mosquitto* mqtt_init() {
 	/* setup callbacks */
 	mosquitto_connect_callback_set(mosq, on_connect);
 	mosquitto_disconnect_callback_set(mosq, on_disconnect);
-	mosquitto_message_callback_set(mosq, on_message);
+	mosquitto_message_callback_set(mosq, on_broker_message);
 	mosquitto_log_callback_set(mosq, on_log);
 
 	/* setup credentials */
@@ -129,8 +328,21 @@ struct mosquitto* mqtt_init() {
 		}
 	}
 
+	/* door daemons on this host reach us without the broker */
+	localbus_init(&local, mosq, NULL, on_message);
+	ret = localbus_open(&local, localdir, "gpio-actor");
+	for (i = 0; !ret && gpios[i].desc.dev; i++) {
+		ret |= localbus_subscribe(&local, gpios[i].topic);
+		ret |= localbus_subscribe(&local, gpios[i].trace_topic);
+	}
+	if (!ret)
+		ret = localbus_start(&local);
+	if (ret)
+		fprintf(stderr, "Local bus disabled: %d\n", ret);
+
 	/* connect to broker */
-	ret = mosquitto_connect(mosq, host, port, keepalv);
+	mqtt_session_init(&session, mosq, delay_min, delay_max);
+	ret = mqtt_session_connect(&session, host, port, keepalv);
 	if (ret) {
 		fprintf(stderr, "Error could not connect to broker: %d\n", ret);
 		return NULL;
@@ -141,6 +353,7 @@ struct mosquitto* mqtt_init() {
 
 int main(int argc, char **argv) {
 	struct mosquitto *mosq;
+	pthread_t thread;
 	int i;
 	int err;
 
@@ -152,6 +365,30 @@ int main(int argc, char **argv) {
 			return 1;
 		}
 		gpio_write(&gpios[i].desc, 0);
+
+		/* non-blocking, a command may re-arm the timer between poll and read */
+		gpios[i].timerfd = timerfd_create(CLOCK_MONOTONIC, TFD_CLOEXEC | TFD_NONBLOCK);
+		if (gpios[i].timerfd < 0) {
+			fprintf(stderr, "could not create timer for \"%s\": %d!\n", gpios[i].desc.name, errno);
+			return 1;
+		}
+
+		gpios[i].trace_topic = trace_topic(gpios[i].topic);
+		if (asprintf(&gpios[i].done_topic, "%s%s", gpios[i].topic, DONE_SUFFIX) < 0)
+			gpios[i].done_topic = NULL;
+		if (!gpios[i].trace_topic || !gpios[i].done_topic) {
+			fprintf(stderr, "Error: Out of memory.\n");
+			return 1;
+		}
+	}
+
+	for (i = 0; i < TRACE_MAX_HOPS; i++)
+		histogram_init(&latency[i], latency_names[i]);
+
+	err = pthread_create(&thread, NULL, pulse_thread, NULL);
+	if (err) {
+		fprintf(stderr, "could not start pulse timer thread: %d\n", err);
+		return 1;
 	}
 
 	/* init mqtt */
@@ -159,17 +396,8 @@ int main(int argc, char **argv) {
 	if (!mosq)
 		return 1;
 
-	/* subscribe */
-	for (i = 0; gpios[i].desc.dev; i++) {
-		err = mosquitto_subscribe(mosq, NULL, gpios[i].topic, 1);
-		if (err) {
-			fprintf(stderr, "could not subscribe to mqtt \"%s\": %d!\n", gpios[i].topic, err);
-			return 1;
-		}
-	}
-
 	/* loop */
-	err = mosquitto_loop_forever(mosq, -1, 1);
+	err = mqtt_session_loop_forever(&session);
 	if (err) {
 		fprintf(stderr, "Error could not start mosquitto network loop: %d\n", err);
 		return 1;
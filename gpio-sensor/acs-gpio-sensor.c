@@ -32,162 +32,68 @@
 #include <inttypes.h>
 #include <dirent.h>
 #include <poll.h>
+#include <sys/epoll.h>
 #include <mosquitto.h>
 #include "../common/config.h"
+#include "../common/mqtt.h"
+#include "../common/trace.h"
+#include "../common/edge.h"
+#include "../common/localbus.h"
+#include "../keyboard/gpio.h"
 
 #define GPIO_TIMEOUT 1000 * 60 * 10
-
-static inline int check_prefix(const char *str, const char *prefix) {
-        return strlen(str) > strlen(prefix) &&
-                strncmp(str, prefix, strlen(prefix)) == 0;
-}
-
-char *symlink_fname(const char *link) {
-	char buf[512];
-	char *tmp;
-	ssize_t s;
-
-	if(!link)
-		return NULL;
-
-	s = readlink(link, buf, sizeof(buf)-1);
-	if (!s)
-		return NULL;
-	buf[s] = '\0';
-	
-	tmp = strrchr(buf, '/');
-	if (!tmp)
-		return NULL;
-
-	return strdup(tmp+1);
-}
-
-char *chip2dev(const char *chipdev) {
-	char *path, *result, *subsystem, *subsystempath;
-	char buf[512];
-	ssize_t s;
-	int i;
-	int t;
-
-	asprintf(&path, "/sys/bus/gpio/devices/%s", chipdev);
-	s = readlink(path, buf, sizeof(buf)-1);
-	free(path);
-	if (!s)
-		return NULL;
-	buf[s] = '\0';
-
-	for(t = 0, i = s; i > 0; i--) {
-		if (buf[i] == '/') {
-			if (t == 0) {
-				buf[i] = '\0';
-				t++;
-				continue;
-			}
-
-			asprintf(&subsystempath, "/sys/bus/gpio/devices/%s/subsystem", buf);
-			subsystem = symlink_fname(subsystempath);
-			free(subsystempath);
-
-			asprintf(&result, "%s/%s", subsystem, buf+i+1);
-			free(subsystem);
-
-			return result;
-		}
-	}
-
-	return NULL;
-}
-
-char* find_gpio_dev(char *dev) {
-	const struct dirent *ent;
-	char *desc;
-	DIR *dp = opendir("/dev");
-	if (!dp)
-		return NULL;
-
-	while (ent = readdir(dp), ent) {
-		if (check_prefix(ent->d_name, "gpiochip")) {
-			desc = chip2dev(ent->d_name);
-			if (strcmp(dev, desc) == 0) {
-				free(desc);
-				asprintf(&desc, "/dev/%s", ent->d_name);
-				return desc;
-			}
-			free(desc);
-		}
-	}
-
-	return NULL;
-}
-
-struct gpiodesc {
-	char *dev;
-	uint8_t offset;
-	char *name;
-	bool output;
-	bool active_low;
-
-	/* private */
-	int fd;
-	int evfd;
-};
+#define GPIO_MAX_CHIPS 4
 
 struct mqttgpio {
 	char *topic;
 	struct gpiodesc desc;
 
+	/* edges within this time (ms) after an accepted edge are bounce */
+	unsigned int settle;
+
 	/* private */
 	uint8_t cached;
+	char *trace_topic;
+	char *event_topic;
+	uint32_t seq;
+	uint32_t lost;
+	unsigned long recovered;
+
+	/* last edge seen while draining the event fd */
+	bool batched;
+	bool batch_value;
+	uint64_t batch_ts;
+
+	/* software debouncer, only used without kernel debounce support */
+	bool debounced;
+	uint64_t accepted;
+	bool checking;
+	bool pending;
+	uint64_t pending_ts;
+	unsigned long suppressed;
 };
 
 struct mqttgpio gpios[] = {
-	{"/access-control-system/main-door/bell-button", { "i2c/1-0021", 3, "maindoor bell button", false, false, -1, -1 }, -1},
-	{"/access-control-system/glass-door/bell-button", { "i2c/1-0022", 7, "glassdoor bell button", false, true, -1, -1 }, -1},
-	{"/access-control-system/glass-door/reed-switch", { "i2c/1-0022", 6, "glassdoor reed sw", false, true, -1, -1 }, -1},
-	{"/access-control-system/glass-door/bolt-contact", { "i2c/1-0022", 5, "glassdoor bolt sw", false, true, -1, -1 }, -1},
-	{"/access-control-system/main-door/reed-switch", { "i2c/1-0021", 2, "maindoor reed sw", false, true, -1, -1 }, -1},
-	{"/access-control-system/outside-door/bell-button", { "i2c/1-0022", 8, "outside bell button", false, true, -1, -1 }, -1},
+	{"/access-control-system/main-door/bell-button", { "i2c/1-0021", 3, "maindoor bell button", GPIO_INPUT, GPIO_ACTIVE_HIGH, -1, -1 }, 20, -1},
+	{"/access-control-system/glass-door/bell-button", { "i2c/1-0022", 7, "glassdoor bell button", GPIO_INPUT, GPIO_ACTIVE_LOW, -1, -1 }, 20, -1},
+	{"/access-control-system/glass-door/reed-switch", { "i2c/1-0022", 6, "glassdoor reed sw", GPIO_INPUT, GPIO_ACTIVE_LOW, -1, -1 }, 50, -1},
+	{"/access-control-system/glass-door/bolt-contact", { "i2c/1-0022", 5, "glassdoor bolt sw", GPIO_INPUT, GPIO_ACTIVE_LOW, -1, -1 }, 50, -1},
+	{"/access-control-system/main-door/reed-switch", { "i2c/1-0021", 2, "maindoor reed sw", GPIO_INPUT, GPIO_ACTIVE_LOW, -1, -1 }, 50, -1},
+	{"/access-control-system/outside-door/bell-button", { "i2c/1-0022", 8, "outside bell button", GPIO_INPUT, GPIO_ACTIVE_LOW, -1, -1 }, 20, -1},
 	{}
 };
 
-int gpio_init(struct gpiodesc *gpio) {
-	char *dev = find_gpio_dev(gpio->dev);
-	if (!dev)
-		return -ENODEV;
-
-	gpio->fd = open(dev, 0);
-	free(dev);
-
-	if (gpio->fd < 0)
-		return -errno;
-
-	struct gpioevent_request req;
-	struct gpioevent_data event;
-
-	req.lineoffset = gpio->offset;
-	strncpy(req.consumer_label, gpio->name, 31);
-
-	req.handleflags = (gpio->output) ? GPIOHANDLE_REQUEST_OUTPUT : GPIOHANDLE_REQUEST_INPUT; 
-	if (gpio->active_low)
-		req.handleflags |= GPIOHANDLE_REQUEST_ACTIVE_LOW;
-
-	if (!gpio->output) {
-		req.eventflags = GPIOEVENT_REQUEST_BOTH_EDGES;
-
-		int err = ioctl(gpio->fd, GPIO_GET_LINEEVENT_IOCTL, &req);
-		if (err < 0) {
-			close(gpio->fd);
-			return -errno;
-		}
-
-		gpio->evfd = req.fd;
-	}
-
-	return 0;
-}
+static struct mqtt_session session;
+static struct localbus local;
 
 static void on_connect(struct mosquitto *m, void *udata, int res) {
 	fprintf(stderr, "Connected.\n");
+	mqtt_session_connected(&session, res);
+}
+
+static void on_disconnect(struct mosquitto *m, void *udata, int res) {
+	fprintf(stderr, "Disconnected.\n");
+	mqtt_session_disconnected(&session, res);
 }
 
 static void on_publish(struct mosquitto *m, void *udata, int m_id) {
@@ -211,6 +117,9 @@ struct mosquitto* mqtt_init() {
 	char *host = cfg_get_default(cfg, "mqtt-broker-host", MQTT_BROKER_HOST);
 	int port = cfg_get_int_default(cfg, "mqtt-broker-port", MQTT_BROKER_PORT);
 	int keepalv = cfg_get_int_default(cfg, "mqtt-keepalive", MQTT_KEEPALIVE_SECONDS);
+	int delay_min = cfg_get_int_default(cfg, "mqtt-reconnect-delay-min", MQTT_RECONNECT_DELAY_MIN);
+	int delay_max = cfg_get_int_default(cfg, "mqtt-reconnect-delay-max", MQTT_RECONNECT_DELAY_MAX);
+	char *localdir = cfg_get_default(cfg, "localbus-dir", LOCALBUS_DIR);
 	cfg_close(cfg);
 
 	/* create mosquitto client instance */
@@ -222,6 +131,7 @@ struct mosquitto* mqtt_init() {
 
 	/* setup callbacks */
 	mosquitto_connect_callback_set(mosq, on_connect);
+	mosquitto_disconnect_callback_set(mosq, on_disconnect);
 	mosquitto_publish_callback_set(mosq, on_publish);
 	mosquitto_log_callback_set(mosq, on_log);
 
@@ -248,14 +158,23 @@ struct mosquitto* mqtt_init() {
 		}
 	}
 
+	/* local consumers get events directly, the broker a copy */
+	mqtt_session_init(&session, mosq, delay_min, delay_max);
+	localbus_init(&local, mosq, NULL, NULL);
+	ret = localbus_open(&local, localdir, NULL);
+	if (ret)
+		fprintf(stderr, "Local bus disabled: %s\n", strerror(-ret));
+	else
+		mqtt_session_set_localbus(&session, &local);
+
 	/* connect to broker */
-	ret = mosquitto_connect(mosq, host, port, keepalv);
+	ret = mqtt_session_connect(&session, host, port, keepalv);
 	if (ret) {
 		fprintf(stderr, "Error could not connect to broker: %d\n", ret);
 		return NULL;
 	}
 
-	ret = mosquitto_loop_start(mosq);
+	ret = mqtt_session_loop_start(&session);
 	if (ret) {
 		fprintf(stderr, "Error could not start mosquitto network loop: %d\n", ret);
 		return NULL;
@@ -264,67 +183,304 @@ struct mosquitto* mqtt_init() {
 	return mosq;
 }
 
+static int publish_state(struct mqttgpio *gpio, bool state, uint64_t timestamp) {
+	static uint16_t trace_seq = 0;
+	int err;
+
+	if (state == gpio->cached)
+		return 0;
+	gpio->cached = state;
+
+	if (gpio->suppressed)
+		printf("gpio %s: %d (%lu bounces suppressed)\n", gpio->topic, state, gpio->suppressed);
+	else
+		printf("gpio %s: %d\n", gpio->topic, state);
+
+	/* trace envelope must arrive before the state change */
+	if (gpio->trace_topic) {
+		struct trace trace;
+		uint8_t buf[TRACE_MAX_SIZE];
+
+		trace_start(&trace, trace_seq++, timestamp);
+		err = trace_pack(&trace, buf, sizeof(buf));
+		mqtt_publish_volatile(&session, gpio->trace_topic, err, buf, 0);
+	}
+
+	/* publish state */
+	err = mqtt_publish_retained(&session, gpio->topic, 1, state ? "1" : "0", 0);
+	if (err) {
+		fprintf(stderr, "Error could not send message: %d\n", err);
+		return err;
+	}
+
+	/* kernel timestamp and sequence number for forensics */
+	if (gpio->event_topic) {
+		struct edge_record record = {
+			.value = state,
+			.seq = gpio->seq++,
+			.lost = gpio->lost,
+			.timestamp = edge_realtime(timestamp),
+		};
+		uint8_t buf[EDGE_SIZE];
+
+		err = edge_pack(&record, buf, sizeof(buf));
+		err = mqtt_publish_retained(&session, gpio->event_topic, err, buf, 0);
+		if (err)
+			fprintf(stderr, "Error could not send message: %d\n", err);
+	}
+
+	return err;
+}
+
+/*
+ * Leading edge debouncer: the first edge after a quiet period is published
+ * right away, edges within the settle time are counted as bounce and the
+ * final level is published once the line settled.
+ */
+static int debounce_edge(struct mqttgpio *gpio, bool state, uint64_t timestamp) {
+	uint64_t settle = gpio->settle * 1000000ULL;
+
+	if (gpio->debounced || !settle)
+		return publish_state(gpio, state, timestamp);
+
+	if (gpio->accepted && timestamp - gpio->accepted < settle) {
+		gpio->suppressed++;
+		gpio->checking = true;
+		gpio->pending = state;
+		gpio->pending_ts = timestamp;
+		return 0;
+	}
+
+	gpio->accepted = timestamp;
+	gpio->checking = false;
+	return publish_state(gpio, state, timestamp);
+}
+
+/*
+ * Reads all lines of a chip at once and publishes levels that differ from
+ * the last published state, e.g. at startup or after a missed edge. Lines
+ * within a software debounce window are left to the debouncer.
+ */
+static int resync(struct gpiogroup *chip, bool startup) {
+	struct mqttgpio *gpio;
+	uint64_t values, now = trace_now();
+	bool level;
+	int i, err;
+
+	err = gpio_group_values(chip, &values);
+	if (err) {
+		fprintf(stderr, "could not read gpios of \"%s\": %d\n", chip->dev, err);
+		return 0;
+	}
+
+	for (i = 0; i < chip->count; i++) {
+		gpio = &gpios[chip->ids[i]];
+		level = (values >> i) & 1;
+
+		if (gpio->checking || level == gpio->cached)
+			continue;
+
+		if (!startup) {
+			gpio->recovered++;
+			fprintf(stderr, "gpio %s: recovered missed edge (%lu total)\n", gpio->topic, gpio->recovered);
+		}
+
+		gpio->accepted = now;
+		err = publish_state(gpio, level, now);
+		if (err)
+			return err;
+	}
+
+	return 0;
+}
+
+/* event timestamps are CLOCK_MONOTONIC since Linux 5.7, like trace_now() */
+static int debounce_check(struct mqttgpio *gpio, uint64_t now) {
+	if (!gpio->checking || now - gpio->accepted < gpio->settle * 1000000ULL)
+		return 0;
+
+	gpio->checking = false;
+	if (gpio->pending == gpio->cached)
+		return 0;
+
+	gpio->accepted = gpio->pending_ts;
+	return publish_state(gpio, gpio->pending, gpio->pending_ts);
+}
+
+/* poll timeout until the next software debounce window closes */
+static int debounce_timeout(uint64_t now) {
+	uint64_t deadline, timeout = GPIO_TIMEOUT;
+	int i;
+
+	for (i = 0; gpios[i].desc.dev; i++) {
+		if (!gpios[i].checking)
+			continue;
+
+		deadline = gpios[i].accepted + gpios[i].settle * 1000000ULL;
+		if (deadline <= now)
+			return 0;
+		if ((deadline - now + 999999) / 1000000 < timeout)
+			timeout = (deadline - now + 999999) / 1000000;
+	}
+
+	return timeout;
+}
+
+/* the kernel event FIFO overflowed */
+static void edge_lost(struct mqttgpio *gpio, uint32_t lost) {
+	gpio->lost += lost;
+	fprintf(stderr, "gpio %s: %u events lost (%u total)\n", gpio->topic, lost, gpio->lost);
+}
+
+/*
+ * Drains the event fd of a chip until it would block (it is edge triggered)
+ * and hands only the final level of each line to the debouncer. Intermediate
+ * edges of a bouncing line never cause a publication, they count as bounces.
+ */
+static int drain_chip(struct gpiogroup *chip) {
+	struct gpio_edge edges[GPIO_GROUP_MAX_EVENTS];
+	struct mqttgpio *gpio;
+	int i, n, err;
+
+	for (;;) {
+		n = gpio_group_read(chip, edges, GPIO_GROUP_MAX_EVENTS);
+		if (n == -EAGAIN)
+			break;
+		if (n < 0) {
+			fprintf(stderr, "read failed: %d\n", n);
+			return n;
+		}
+
+		for (i = 0; i < n; i++) {
+			gpio = &gpios[edges[i].id];
+
+			if (edges[i].lost)
+				edge_lost(gpio, edges[i].lost);
+
+			/* the batch keeps the timestamp of its first edge */
+			if (gpio->batched) {
+				gpio->suppressed++;
+			} else {
+				gpio->batched = true;
+				gpio->batch_ts = edges[i].timestamp;
+			}
+			gpio->batch_value = edges[i].value;
+		}
+	}
+
+	for (i = 0; i < chip->count; i++) {
+		gpio = &gpios[chip->ids[i]];
+		if (!gpio->batched)
+			continue;
+
+		gpio->batched = false;
+		err = debounce_edge(gpio, gpio->batch_value, gpio->batch_ts);
+		if (err)
+			return err;
+	}
+
+	return 0;
+}
+
 int main(int argc, char **argv) {
-	struct gpioevent_data event;
+	struct gpiogroup chips[GPIO_MAX_CHIPS] = {};
+	struct epoll_event ev, events[GPIO_MAX_CHIPS];
 	struct mosquitto *mosq;
-	struct pollfd *fdset;
-	int i, nfds;
+	uint64_t next_resync;
+	int i, j, n, nfds, epfd, timeout;
 	int err;
 
-	/* setup gpios */
+	FILE *cfg = cfg_open();
+	bool tracing = cfg_get_int_default(cfg, "latency-trace", LATENCY_TRACE) > 0;
+	uint64_t resync_interval = cfg_get_int_default(cfg, "gpio-resync-interval", GPIO_RESYNC_INTERVAL) * 1000000000ULL;
+	cfg_close(cfg);
+
+	/* setup gpios, one line request per chip */
 	for (i = 0; gpios[i].desc.dev; i++) {
-		int err = gpio_init(&gpios[i].desc);
+		err = gpio_group_add(chips, GPIO_MAX_CHIPS, &gpios[i].desc, i, gpios[i].settle);
+		if (err < 0) {
+			fprintf(stderr, "could not add gpio \"%s\": %d!\n", gpios[i].desc.name, err);
+			return 1;
+		}
+
+		if (tracing)
+			gpios[i].trace_topic = trace_topic(gpios[i].topic);
+
+		gpios[i].event_topic = edge_topic(gpios[i].topic);
+	}
+
+	for (nfds = 0; nfds < GPIO_MAX_CHIPS && chips[nfds].dev; nfds++) {
+		err = gpio_group_request(&chips[nfds]);
 		if (err) {
-			fprintf(stderr, "could not init gpio \"%s\": %d!\n", gpios[i].desc.name, err);
+			fprintf(stderr, "could not init gpios of \"%s\": %d!\n", chips[nfds].dev, err);
 			return 1;
 		}
+
+		if (!chips[nfds].debounced)
+			fprintf(stderr, "gpios of \"%s\": no kernel debounce, using software debouncer\n", chips[nfds].dev);
+
+		for (j = 0; j < chips[nfds].count; j++)
+			gpios[chips[nfds].ids[j]].debounced = chips[nfds].debounced;
 	}
-	nfds = i;
 
-	/* setup fdset */
-	fdset = calloc(sizeof(struct pollfd), nfds);
-	for (i = 0; gpios[i].desc.dev; i++) {
-		fdset[i].fd = gpios[i].desc.evfd;
-		fdset[i].events = POLLIN|POLLPRI;
+	/* edge triggered, every wakeup drains the whole fd */
+	epfd = epoll_create1(EPOLL_CLOEXEC);
+	if (epfd < 0) {
+		fprintf(stderr, "could not create epoll instance: %d\n", errno);
+		return 1;
+	}
+
+	for (i = 0; i < nfds; i++) {
+		fcntl(chips[i].evfd, F_SETFL, fcntl(chips[i].evfd, F_GETFL) | O_NONBLOCK);
+
+		ev.events = EPOLLIN | EPOLLET;
+		ev.data.u32 = i;
+		if (epoll_ctl(epfd, EPOLL_CTL_ADD, chips[i].evfd, &ev)) {
+			fprintf(stderr, "could not watch gpios of \"%s\": %d\n", chips[i].dev, errno);
+			return 1;
+		}
 	}
-	
+
 	mosq = mqtt_init();
 	if (!mosq)
 		return 1;
 
-	for(;;) {
-		err = poll(fdset, nfds, GPIO_TIMEOUT);
-		if (err < 0) {
-			fprintf(stderr, "failed to poll gpios: %d\n", err);
+	/* retained topics may be stale, publish the initial levels */
+	for (i = 0; i < nfds; i++)
+		if (resync(&chips[i], true))
 			return 1;
-		}
+	next_resync = trace_now() + resync_interval;
 
-		for (i=0; i < nfds; i++) {
-			bool state;
+	for(;;) {
+		timeout = debounce_timeout(trace_now());
+		if (resync_interval) {
+			uint64_t now = trace_now();
+			int ms = (next_resync > now) ? (next_resync - now + 999999) / 1000000 : 0;
+			if (ms < timeout)
+				timeout = ms;
+		}
 
-			if ((fdset[i].revents & POLLIN) == 0)
+		n = epoll_wait(epfd, events, GPIO_MAX_CHIPS, timeout);
+		if (n < 0) {
+			if (errno == EINTR)
 				continue;
+			fprintf(stderr, "failed to wait for gpios: %d\n", errno);
+			return 1;
+		}
 
-			err = read(gpios[i].desc.evfd, &event, sizeof(event));
-			if (err < 0) {
-				fprintf(stderr, "read failed: %d\n", errno);
+		for (i = 0; i < n; i++)
+			if (drain_chip(&chips[events[i].data.u32]))
 				return 1;
-			}
 
-			state = (event.id == GPIOEVENT_EVENT_RISING_EDGE);
-
-			if (state == gpios[i].cached)
-				continue;
-			gpios[i].cached = state;
-
-			printf("gpio %s: %d\n", gpios[i].topic, state);
-
-			/* publish state */
-			err = mosquitto_publish(mosq, NULL, gpios[i].topic, 1, state ? "1" : "0", 0, true);
-			if (err) {
-				fprintf(stderr, "Error could not send message: %d\n", err);
+		for (i=0; gpios[i].desc.dev; i++)
+			if (debounce_check(&gpios[i], trace_now()))
 				return 1;
-			}
+
+		if (resync_interval && trace_now() >= next_resync) {
+			for (i = 0; i < nfds; i++)
+				if (resync(&chips[i], false))
+					return 1;
+			next_resync = trace_now() + resync_interval;
 		}
 	}
 
@@ -32,10 +32,11 @@
 #include <arpa/inet.h>
 #include <sys/inotify.h>
 #include <pthread.h>
+#include <time.h>
 
-#include "../keyboard/gpio.h"
 #include "../common/config.h"
 #include "../common/i2c.h"
+#include "../common/snapshot.h"
 
 #define BLACK  0x00000000
 #define YELLOW 0x40400000
@@ -57,9 +58,33 @@
 #define TOPIC_BOLT_STATE "/access-control-system/main-door/bolt-state"
 #define TOPIC_MAIN_DOOR_BUZZER "/access-control-system/main-door/buzzer"
 #define TOPIC_GLASS_DOOR_BUZZER "/access-control-system/glass-door/buzzer"
+/* published by acs-gpio-actor when a buzzer pulse is over */
+#define TOPIC_MAIN_DOOR_BUZZER_DONE TOPIC_MAIN_DOOR_BUZZER "/done"
+#define TOPIC_GLASS_DOOR_BUZZER_DONE TOPIC_GLASS_DOOR_BUZZER "/done"
 #define TOPIC_STATE_CUR "/access-control-system/space-state"
 #define TOPIC_STATE_NEXT "/access-control-system/space-state-next"
 
+#define LED_COUNT 34
+
+/* LEDs per SMBus block write (32 byte) */
+#define LED_BLOCK_MAX 8
+
+/* Fletcher-16 over the first [len] registers, see tiny-led-firmware */
+#define LED_REG_CHECKSUM 0xfe
+
+/* LED writes between begin and apply are committed together */
+#define LED_REG_COMMIT 0xfd
+#define LED_COMMIT_BEGIN 0x01
+#define LED_COMMIT_APPLY 0x02
+
+/* LED ranges sharing one command register: [R][G][B][C] and [FIRST][COUNT][0][0] */
+#define LED_REG_SEGMENT 0xc0
+#define LED_REG_SEGDEF 0xe0
+#define LED_SEGMENTS 8
+
+/* seconds between checks of an otherwise unchanged frame */
+#define LED_VERIFY_INTERVAL 600
+
 /* check all 10 minutes even witout inotify event */
 #define POLL_TIMEOUT 10 * 60 * 1000
 
@@ -95,10 +120,10 @@ enum bus {
 	EXTERNAL
 };
 
-/* high = i2c mode, low = led mode ; led -> i2c mode switch needs 1ms */
-struct gpiodesc modegpio = { "platform/gpio-sc18is600", 0, "tiny-ws2812 mode", true, false, -1, -1 };
-
+/* protects the state in userdata and render_pending, not the I2C bus */
 pthread_mutex_t mutex = PTHREAD_MUTEX_INITIALIZER;
+pthread_cond_t render_cond = PTHREAD_COND_INITIALIZER;
+static bool render_pending;
 
 struct userdata {
 	int i2c;
@@ -125,6 +150,27 @@ struct userdata {
 
 	/* true if glass-door buzzer is active */
 	bool buzzer_glassdoor;
+
+	/* last aggregated state per bus, preferred over the per-field topics */
+	struct snapshot snapshot[EXTERNAL+1];
+	bool snapshot_seen[EXTERNAL+1];
+
+	/* last register values confirmed by the controller */
+	uint32_t shadow[LED_COUNT];
+	bool shadow_valid[LED_COUNT];
+
+	/* max. LEDs written with one message */
+	int burst;
+	bool plain;
+
+	/* compare the controller's checksum with the shadow after each frame */
+	bool verify;
+	time_t verified;
+	int i2c_addr;
+
+	/* write scene segments through the controller's segment registers */
+	bool segments;
+	bool segments_defined;
 };
 struct userdata *globaldata;
 
@@ -164,115 +210,507 @@ static void on_subscribe(struct mosquitto *m, void *udata, int mid, int qos_coun
 	fprintf(stderr, "\n");
 }
 
-static bool led_get(struct userdata *udata, uint8_t i, uint32_t *val) {
-	uint32_t readval;
-	int retries, err;
-	int fd = udata->i2c;
+enum location {
+	LOCATION_BELL_BUTTON_GLASS,
+	LOCATION_INDOOR_LOCAL,
+	LOCATION_INDOOR_INTERNAL,
+	LOCATION_INDOOR_EXTERNAL,
+	LOCATION_KEYPAD,
+	LOCATION_BELL_BUTTON_MAIN,
+	LOCATION_STRIPE,
+	LOCATION_ALL,
+	LOCATION_MAX
+};
 
-	for(retries = 0; retries < 3; retries++) {
-		err = i2c_smbus_read_i2c_block_data(fd, i, 4, (uint8_t*) &readval);
-		if (err == -1)
-			continue;
-		*val = ntohl(readval);
-		return true;
+/* [start, stop) of each location */
+static const uint8_t location_range[LOCATION_MAX][2] = {
+	[LOCATION_BELL_BUTTON_GLASS] = { 0, 1 },
+	[LOCATION_INDOOR_LOCAL] = { 1, 2 },
+	[LOCATION_INDOOR_INTERNAL] = { 2, 3 },
+	[LOCATION_INDOOR_EXTERNAL] = { 3, 4 },
+	[LOCATION_KEYPAD] = { 4, 9 },
+	[LOCATION_BELL_BUTTON_MAIN] = { 9, 10 },
+	[LOCATION_STRIPE] = { 10, LED_COUNT },
+	[LOCATION_ALL] = { 0, LED_COUNT },
+};
+
+static const char *location_names[LOCATION_MAX] = {
+	[LOCATION_BELL_BUTTON_GLASS] = "bell-button-glass",
+	[LOCATION_INDOOR_LOCAL] = "indoor-local",
+	[LOCATION_INDOOR_INTERNAL] = "indoor-internal",
+	[LOCATION_INDOOR_EXTERNAL] = "indoor-external",
+	[LOCATION_KEYPAD] = "keypad",
+	[LOCATION_BELL_BUTTON_MAIN] = "bell-button-main",
+	[LOCATION_STRIPE] = "stripe",
+	[LOCATION_ALL] = "all",
+};
+
+/* color of a scene layer, the first three follow the space state of a bus */
+enum scene_source {
+	SOURCE_LOCAL,
+	SOURCE_INTERNAL,
+	SOURCE_EXTERNAL,
+	SOURCE_FIXED,
+};
+
+/* layer conditions, a layer is applied if all its flags are set */
+#define SCENE_BOLT 0x01
+#define SCENE_BUZZER_MAINDOOR 0x02
+#define SCENE_BUZZER_GLASSDOOR 0x04
+
+#define SCENE_MAX_LAYERS 32
+#define SCENE_CACHE_SIZE 64
+
+struct scene_layer {
+	uint8_t start;
+	uint8_t stop;
+	enum scene_source source;
+	uint32_t color;
+	uint8_t flags;
+};
+
+/* everything a frame depends on */
+struct scene_key {
+	uint32_t colors[SOURCE_FIXED];
+	uint8_t flags;
+};
+
+struct scene_image {
+	bool used;
+	struct scene_key key;
+	uint32_t frame[LED_COUNT];
+};
+
+/* same syntax as a scene file, later layers override earlier ones */
+static const char *default_scene[] = {
+	"all internal",
+	"indoor-local local",
+	"indoor-external external",
+	"keypad 0x00000000 bolt",
+	"keypad 0x00800088 buzzer-main",
+	"bell-button-main 0x00800088 buzzer-main",
+	"bell-button-glass 0x00800088 buzzer-glass",
+	NULL
+};
+
+/* only used by the render thread after startup */
+static struct scene_layer scene[SCENE_MAX_LAYERS];
+static int scene_layers;
+static struct scene_image scene_cache[SCENE_CACHE_SIZE];
+
+/* LED ranges every layer treats as a whole, they always share one color */
+static uint8_t scene_segment_range[LED_SEGMENTS][2];
+static int scene_segments;
+static int8_t scene_segment[LED_COUNT];
+
+/* <location|led|first-last> <local|internal|external|0xRRGGBBcc> [bolt|buzzer-main|buzzer-glass] */
+static int scene_parse(const char *line, struct scene_layer *layer) {
+	char target[32], source[32], cond[32];
+	unsigned int first, last;
+	char *end;
+	int i, n;
+
+	n = sscanf(line, "%31s %31s %31s", target, source, cond);
+	if (n < 2)
+		return -EINVAL;
+
+	memset(layer, 0, sizeof(*layer));
+
+	for(i=0; i < LOCATION_MAX; i++) {
+		if (!strcmp(target, location_names[i])) {
+			layer->start = location_range[i][0];
+			layer->stop = location_range[i][1];
+			break;
+		}
 	}
 
-	return false;
+	if (i == LOCATION_MAX) {
+		i = sscanf(target, "%u-%u", &first, &last);
+		if (i == 1)
+			last = first;
+		if (i < 1 || first > last || last >= LED_COUNT)
+			return -EINVAL;
+		layer->start = first;
+		layer->stop = last + 1;
+	}
+
+	if (!strcmp(source, "local")) {
+		layer->source = SOURCE_LOCAL;
+	} else if (!strcmp(source, "internal")) {
+		layer->source = SOURCE_INTERNAL;
+	} else if (!strcmp(source, "external")) {
+		layer->source = SOURCE_EXTERNAL;
+	} else {
+		layer->source = SOURCE_FIXED;
+		layer->color = strtoul(source, &end, 0);
+		if (*end)
+			return -EINVAL;
+	}
+
+	if (n < 3)
+		return 0;
+
+	if (!strcmp(cond, "bolt"))
+		layer->flags = SCENE_BOLT;
+	else if (!strcmp(cond, "buzzer-main"))
+		layer->flags = SCENE_BUZZER_MAINDOOR;
+	else if (!strcmp(cond, "buzzer-glass"))
+		layer->flags = SCENE_BUZZER_GLASSDOOR;
+	else
+		return -EINVAL;
 
+	return 0;
 }
 
-static bool led_set(struct userdata *udata, uint8_t i, uint32_t val) {
-	uint32_t beval = htonl(val);
-	int retries, err;
-	int fd = udata->i2c;
+static int scene_add(const char *line, const char *file, int lineno) {
+	if (scene_layers == SCENE_MAX_LAYERS) {
+		fprintf(stderr, "%s:%d: more than %d layers\n", file, lineno, SCENE_MAX_LAYERS);
+		return -ENOSPC;
+	}
 
-	for(retries = 0; retries < 5; retries++) {
-		err = i2c_smbus_write_i2c_block_data(fd, i, 4, (uint8_t*) &beval);
-		if (err == -1)
-			continue;
-		return true;
+	if (scene_parse(line, &scene[scene_layers])) {
+		fprintf(stderr, "%s:%d: invalid layer: %s\n", file, lineno, line);
+		return -EINVAL;
+	}
+
+	scene_layers++;
+	return 0;
+}
+
+/* splits the LEDs at every layer border, ranges of 2+ LEDs become segments */
+static void scene_find_segments() {
+	bool border[LED_COUNT + 1] = {};
+	int i, start;
+
+	scene_segments = 0;
+	memset(scene_segment, -1, sizeof(scene_segment));
+
+	for(i=0; i < scene_layers; i++) {
+		border[scene[i].start] = true;
+		border[scene[i].stop] = true;
 	}
 
-	return false;
+	for(start=0, i=1; i <= LED_COUNT; i++) {
+		if (i < LED_COUNT && !border[i])
+			continue;
+
+		if (i - start >= 2 && scene_segments < LED_SEGMENTS) {
+			scene_segment_range[scene_segments][0] = start;
+			scene_segment_range[scene_segments][1] = i;
+			memset(scene_segment + start, scene_segments, i - start);
+			scene_segments++;
+		}
+
+		start = i;
+	}
 }
 
-static bool led_check(struct userdata *udata, uint8_t i, uint32_t val) {
-	uint32_t beval = htonl(val);
-	uint32_t readval;
-	int retries, err;
-	int fd = udata->i2c;
+/* an empty path selects the built-in scene */
+static int scene_load(const char *path) {
+	char *line = NULL, *p;
+	size_t len = 0;
+	int i, ret = 0;
+	FILE *f;
+
+	scene_layers = 0;
 
-	for(retries = 0; retries < 5; retries++) {
-		err = i2c_smbus_read_i2c_block_data(fd, i, 4, (uint8_t*) &readval);
-		if (err == -1)
+	if (!path || !*path) {
+		for(i=0; default_scene[i]; i++) {
+			ret = scene_add(default_scene[i], "default scene", i + 1);
+			if (ret)
+				return ret;
+		}
+		scene_find_segments();
+		return 0;
+	}
+
+	f = fopen(path, "r");
+	if (!f) {
+		fprintf(stderr, "could not open %s\n", path);
+		return -errno;
+	}
+
+	for(i=1; getline(&line, &len, f) > 0; i++) {
+		p = strchr(line, '#');
+		if (p)
+			*p = '\0';
+		p = line + strspn(line, " \t");
+		p[strcspn(p, "\r\n")] = '\0';
+		if (!*p)
 			continue;
-		readval = ntohl(readval);
-		if ((val & 0xffffffff) == (readval & 0xffffffff))
-			return true;
-		led_set(udata, i, val);
-		usleep(1000);
+
+		ret = scene_add(p, path, i);
+		if (ret)
+			break;
 	}
 
-	return false;
+	free(line);
+	fclose(f);
+
+	scene_find_segments();
+	return ret;
 }
 
-enum location {
-	LOCATION_BELL_BUTTON_GLASS,
-	LOCATION_INDOOR_LOCAL,
-	LOCATION_INDOOR_INTERNAL,
-	LOCATION_INDOOR_EXTERNAL,
-	LOCATION_KEYPAD,
-	LOCATION_BELL_BUTTON_MAIN,
-	LOCATION_STRIPE,
-	LOCATION_ALL,
-	LOCATION_MAX
-};
+static void scene_compile(const struct scene_key *key, uint32_t *frame) {
+	uint32_t color;
+	int i, j;
+
+	memset(frame, 0, LED_COUNT * sizeof(*frame));
+
+	for(i=0; i < scene_layers; i++) {
+		if ((key->flags & scene[i].flags) != scene[i].flags)
+			continue;
+
+		if (scene[i].source == SOURCE_FIXED)
+			color = scene[i].color;
+		else
+			color = key->colors[scene[i].source];
 
-static void sed_multi_led(struct userdata *udata, uint8_t location, uint32_t color) {
-	int start=0;
-	int stop=0;
+		for(j=scene[i].start; j < scene[i].stop; j++)
+			frame[j] = color;
+	}
+}
+
+static bool scene_key_equal(const struct scene_key *a, const struct scene_key *b) {
 	int i;
 
-	if(location >= LOCATION_MAX)
-		return;
+	for(i=0; i < SOURCE_FIXED; i++)
+		if (a->colors[i] != b->colors[i])
+			return false;
 
-	switch(location) {
-		case LOCATION_BELL_BUTTON_GLASS:
-			start=0;
-			stop=1;
-			break;
-		case LOCATION_INDOOR_LOCAL:
-			start=1;
-			stop=2;
-			break;
-		case LOCATION_INDOOR_INTERNAL:
-			start=2;
-			stop=3;
-			break;
-		case LOCATION_INDOOR_EXTERNAL:
-			start=3;
-			stop=4;
-			break;
-		case LOCATION_KEYPAD:
-			start=4;
-			stop=9;
-			break;
-		case LOCATION_BELL_BUTTON_MAIN:
-			start=9;
-			stop=10;
-			break;
-		case LOCATION_STRIPE:
-			start=10;
-			stop=34;
-			break;
-		case LOCATION_ALL:
-			start=0;
-			stop=34;
+	return a->flags == b->flags;
+}
+
+/*
+ * Register image for a state combination, compiled on first use. The
+ * returned frame stays valid until the next lookup.
+ */
+static const uint32_t *scene_lookup(const struct scene_key *key) {
+	struct scene_image *img;
+	uint32_t hash = 2166136261u;
+	int i;
+
+	/* FNV-1a */
+	for(i=0; i < SOURCE_FIXED; i++)
+		hash = (hash ^ key->colors[i]) * 16777619u;
+	hash = (hash ^ key->flags) * 16777619u;
+
+	img = &scene_cache[hash % SCENE_CACHE_SIZE];
+	if (img->used && scene_key_equal(&img->key, key))
+		return img->frame;
+
+	/* a collision simply replaces the older image */
+	img->used = true;
+	img->key = *key;
+	scene_compile(key, img->frame);
+
+	return img->frame;
+}
+
+static bool led_dirty(struct userdata *udata, const uint32_t *frame, int i) {
+	return !udata->shadow_valid[i] || udata->shadow[i] != frame[i];
+}
+
+/* number of LEDs whose register differs from the shadow */
+static int frame_dirty(struct userdata *udata, const uint32_t *frame) {
+	int i, dirty = 0;
+
+	for(i=0; i < LED_COUNT; i++)
+		if (led_dirty(udata, frame, i))
+			dirty++;
+
+	return dirty;
+}
+
+/*
+ * Assigns the scene segments to the controller's segment registers, unused
+ * ones are cleared. The controller forgets them on reset, so this is
+ * repeated after a repair.
+ */
+static int segments_define(struct userdata *udata) {
+	uint8_t buf[LED_SEGMENTS * 4] = {};
+	struct i2c_segment seg = { .reg = LED_REG_SEGDEF, .len = sizeof(buf), .buf = buf };
+	int i, ret;
+
+	for(i=0; i < scene_segments; i++) {
+		buf[4 * i] = scene_segment_range[i][0];
+		buf[4 * i + 1] = scene_segment_range[i][1] - scene_segment_range[i][0];
+	}
+
+	ret = i2c_transfer(udata->i2c, udata->i2c_addr, udata->plain, &seg, 1);
+	if (ret < 0)
+		return ret;
+
+	udata->segments_defined = true;
+	return 0;
+}
+
+/* Fletcher-16 over the registers as the controller returns them */
+static uint16_t frame_checksum(const uint32_t *frame, int count) {
+	uint16_t sum1 = 0, sum2 = 0;
+	int i, j;
+
+	for(i=0; i < count; i++) {
+		for(j=24; j >= 0; j -= 8) {
+			sum1 = (sum1 + ((frame[i] >> j) & 0xff)) % 255;
+			sum2 = (sum2 + sum1) % 255;
+		}
+	}
+
+	return (sum2 << 8) | sum1;
+}
+
+/*
+ * Writes the dirty LEDs and reads the controller's checksum with a single
+ * combined transfer. Each run of contiguous dirty LEDs is one segment, the
+ * controller increments the LED address after every 4 bytes. A dirty scene
+ * segment is a single write to its segment register instead. The runs are
+ * staged in the controller's back buffer and committed together, so the
+ * frame never shows up half applied. Clean LEDs are never rewritten, that
+ * would restart their fade or blink. Failed writes stay invalid in the
+ * shadow, so they are retried with the next frame. Returns false if the
+ * checksum does not match the shadow.
+ */
+static bool frame_commit(struct userdata *udata, const uint32_t *frame) {
+	struct i2c_segment segs[I2C_SEGMENTS_MAX];
+	uint8_t buf[LED_COUNT * 4];
+	uint8_t sumlen[4] = { LED_COUNT, 0, 0, 0 };
+	uint8_t sum[2] = { 0, 0 };
+	uint8_t begin[4] = { LED_COMMIT_BEGIN, 0, 0, 0 };
+	uint8_t apply[4] = { LED_COMMIT_APPLY, 0, 0, 0 };
+	int n, start, first, last, i = 0, end, j, s, retries, err = 0;
+	bool checked = false, staged = false, grouped;
+	uint32_t beval;
+
+	if (udata->segments && !udata->segments_defined && segments_define(udata))
+		fprintf(stderr, "Could not define LED segments, writing single LEDs\n");
+	grouped = udata->segments && udata->segments_defined;
+
+	do {
+		/* segs[0] is reserved for the begin, three more for commit and checksum */
+		n = 1;
+		first = -1;
+		last = 0;
+
+		for(; i < LED_COUNT && n < I2C_SEGMENTS_MAX - 3; i = end) {
+			s = grouped ? scene_segment[i] : -1;
+			end = (s < 0) ? i + 1 : scene_segment_range[s][1];
+			for(j=i; j < end && !led_dirty(udata, frame, j); j++)
+				;
+			if (j == end)
+				continue;
+
+			if (s >= 0) {
+				beval = htonl(frame[i]);
+				memcpy(buf + 4 * i, &beval, 4);
+				segs[n++] = (struct i2c_segment) { .reg = LED_REG_SEGMENT + s, .len = 4, .buf = buf + 4 * i };
+				if (first < 0)
+					first = i;
+				last = end;
+				continue;
+			}
+
+			while (end < LED_COUNT && end - i < udata->burst && led_dirty(udata, frame, end) &&
+			       (!grouped || scene_segment[end] < 0))
+				end++;
+
+			for(j=i; j < end; j++) {
+				beval = htonl(frame[j]);
+				memcpy(buf + 4 * j, &beval, 4);
+			}
+
+			segs[n++] = (struct i2c_segment) { .reg = i, .len = 4 * (end - i), .buf = buf + 4 * i };
+			if (first < 0)
+				first = i;
+			last = end;
+		}
+
+		start = 1;
+		if (first >= 0 && !staged) {
+			segs[0] = (struct i2c_segment) { .reg = LED_REG_COMMIT, .len = sizeof(begin), .buf = begin };
+			staged = true;
+			start = 0;
+		}
+
+		if (i == LED_COUNT && staged)
+			segs[n++] = (struct i2c_segment) { .reg = LED_REG_COMMIT, .len = sizeof(apply), .buf = apply };
+
+		if (i == LED_COUNT && udata->verify) {
+			segs[n++] = (struct i2c_segment) { .reg = LED_REG_CHECKSUM, .len = sizeof(sumlen), .buf = sumlen };
+			segs[n++] = (struct i2c_segment) { .reg = LED_REG_CHECKSUM, .read = true, .len = sizeof(sum), .buf = sum };
+			checked = true;
+		}
+
+		if (n == start)
 			break;
+
+		for(retries = 0; retries < 5; retries++) {
+			err = i2c_transfer(udata->i2c, udata->i2c_addr, udata->plain, segs + start, n - start);
+			if (err >= 0)
+				break;
+		}
+
+		for(j=first; first >= 0 && j < last; j++) {
+			if (!led_dirty(udata, frame, j))
+				continue;
+
+			udata->shadow[j] = frame[j];
+			udata->shadow_valid[j] = err >= 0;
+		}
+	} while (i < LED_COUNT);
+
+	if (!checked || err < 0)
+		return true;
+
+	if (((sum[0] << 8) | sum[1]) != frame_checksum(udata->shadow, LED_COUNT))
+		return false;
+
+	udata->verified = time(NULL);
+	return true;
+}
+
+/*
+ * Reads the whole register file in one burst and invalidates every LED
+ * that differs from the shadow. Returns the number of mismatching LEDs.
+ */
+static int frame_repair(struct userdata *udata) {
+	struct i2c_segment segs[I2C_SEGMENTS_MAX];
+	uint8_t buf[LED_COUNT * 4];
+	uint32_t val;
+	int i, n = 0, step, mismatch = 0;
+
+	/* SMBus-only adapters cannot read more than one block */
+	step = udata->plain ? LED_COUNT : LED_BLOCK_MAX;
+
+	for(i=0; i < LED_COUNT; i += step) {
+		segs[n++] = (struct i2c_segment) {
+			.reg = i,
+			.read = true,
+			.len = 4 * ((LED_COUNT - i < step) ? LED_COUNT - i : step),
+			.buf = buf + 4 * i,
+		};
+	}
+
+	if (i2c_transfer(udata->i2c, udata->i2c_addr, udata->plain, segs, n) < 0) {
+		fprintf(stderr, "Could not read back LED registers\n");
+		return 0;
+	}
+
+	for(i=0; i < LED_COUNT; i++) {
+		memcpy(&val, buf + 4 * i, 4);
+		if (!udata->shadow_valid[i] || ntohl(val) == udata->shadow[i])
+			continue;
+
+		udata->shadow_valid[i] = false;
+		mismatch++;
 	}
 
-	for(i=start; i < stop; i++)
-		led_set(udata, i, color);
+	/* most likely a controller reset, which also cleared the segments */
+	if (mismatch)
+		udata->segments_defined = false;
+
+	fprintf(stderr, "LED checksum mismatch, %d LEDs differ\n", mismatch);
+	return mismatch;
 }
 
 static uint32_t state2color(enum states2 curstate, enum states2 nextstate) {
@@ -324,48 +762,74 @@ static void dump(struct userdata *udata) {
 		states[udata->curstate_external], states[udata->nextstate_external]);
 }
 
-static void display_state(struct userdata *udata) {
-	pthread_mutex_lock(&mutex);
+/* called with mutex held */
+static const uint32_t *compose_frame(struct userdata *udata) {
+	struct scene_key key = {};
+
+	key.colors[SOURCE_LOCAL] = state2color(udata->curstate_local, udata->nextstate_local) | (MODE_FADE | 63);
+	key.colors[SOURCE_INTERNAL] = state2color(udata->curstate_internal, udata->nextstate_internal) | (MODE_FADE | 63);
+	key.colors[SOURCE_EXTERNAL] = state2color(udata->curstate_external, udata->nextstate_external) | (MODE_FADE | 63);
+
+	if (udata->bolt)
+		key.flags |= SCENE_BOLT;
+	if (udata->buzzer_maindoor)
+		key.flags |= SCENE_BUZZER_MAINDOOR;
+	if (udata->buzzer_glassdoor)
+		key.flags |= SCENE_BUZZER_GLASSDOOR;
+
+	return scene_lookup(&key);
+}
 
-	dump(udata);
+/*
+ * Only the render thread touches the bus and the shadow. Any number of
+ * updates that arrive while a frame is being written are coalesced into
+ * the next frame, which is composed from the latest state.
+ */
+static void *render_thread(void *data) {
+	struct userdata *udata = data;
+	const uint32_t *frame;
+	struct timespec timeout;
 
-	/* local */
-	uint32_t color_loc = state2color(udata->curstate_local, udata->nextstate_local);
-	color_loc |= (MODE_FADE | 63);
+	pthread_mutex_lock(&mutex);
 
-	/* internal */
-	uint32_t color_int = state2color(udata->curstate_internal, udata->nextstate_internal);
-	color_int |= (MODE_FADE | 63);
+	for (;;) {
+		clock_gettime(CLOCK_REALTIME, &timeout);
+		timeout.tv_sec += LED_VERIFY_INTERVAL;
 
-	/* external */
-	uint32_t color_ext = state2color(udata->curstate_external, udata->nextstate_external);
-	color_ext |= (MODE_FADE | 63);
+		while (!render_pending) {
+			if (pthread_cond_timedwait(&render_cond, &mutex, &timeout) == ETIMEDOUT)
+				break;
+		}
 
-	uint32_t greenblink = GREEN | (MODE_BLINK | 8);
+		render_pending = false;
+		dump(udata);
+		frame = compose_frame(udata);
+		pthread_mutex_unlock(&mutex);
 
-	gpio_write(&modegpio, 1);
-	usleep(1000);
-	sed_multi_led(udata, LOCATION_ALL, color_int);
-	sed_multi_led(udata, LOCATION_INDOOR_LOCAL, color_loc);
-	sed_multi_led(udata, LOCATION_INDOOR_EXTERNAL, color_ext);
-	if (udata->bolt) {
-		sed_multi_led(udata, LOCATION_KEYPAD, BLACK);
-	}
-	if (udata->buzzer_maindoor) {
-		sed_multi_led(udata, LOCATION_KEYPAD, greenblink);
-		sed_multi_led(udata, LOCATION_BELL_BUTTON_MAIN, greenblink);
-	}
-	if (udata->buzzer_glassdoor) {
-		sed_multi_led(udata, LOCATION_BELL_BUTTON_GLASS, greenblink);
+		/* the controller listens while animating, unchanged frames only need a periodic check */
+		if (frame_dirty(udata, frame) || (udata->verify && time(NULL) - udata->verified >= LED_VERIFY_INTERVAL)) {
+			if (!frame_commit(udata, frame) && frame_repair(udata))
+				frame_commit(udata, udata->shadow);
+		}
+
+		pthread_mutex_lock(&mutex);
 	}
-	gpio_write(&modegpio, 0);
 
+	return NULL;
+}
+
+/* never blocks on the bus, the render thread picks up the latest state */
+static void display_state(struct userdata *udata) {
+	pthread_mutex_lock(&mutex);
+	render_pending = true;
+	pthread_cond_signal(&render_cond);
 	pthread_mutex_unlock(&mutex);
 }
 
 static void set_state(struct userdata *udata, enum bus bus, int curstate, int nextstate) {
 	printf("[bus=%d] curstate: %s - nextstate: %s\n", bus, states[curstate], states[nextstate]);
 
+	pthread_mutex_lock(&mutex);
 	switch(bus) {
 		case LOCAL:
 			if (curstate >= 0)
@@ -386,9 +850,10 @@ static void set_state(struct userdata *udata, enum bus bus, int curstate, int ne
 				udata->nextstate_external = nextstate;
 			break;
 	}
+	pthread_mutex_unlock(&mutex);
 }
 
-static enum states2 str2state(char *state, uint32_t len) {
+static enum states2 str2state(const char *state, uint32_t len) {
 	int curstate = STATE_UNKNOWN;
 	int i;
 
@@ -425,6 +890,12 @@ static void on_connect(struct mosquitto *m, void *data, int res) {
 		exit(1);
 	}
 
+	ret = mosquitto_subscribe(m, NULL, SNAPSHOT_TOPIC, 1);
+	if (ret) {
+		fprintf(stderr, "Error could not subscribe to %s: %d\n", SNAPSHOT_TOPIC, ret);
+		exit(1);
+	}
+
 	/* the following topics are only registered for the internal mqtt server */
 	if (b != INTERNAL)
 		return;
@@ -446,6 +917,18 @@ static void on_connect(struct mosquitto *m, void *data, int res) {
 		fprintf(stderr, "Error could not subscribe to %s: %d\n", TOPIC_GLASS_DOOR_BUZZER, ret);
 		exit(1);
 	}
+
+	ret = mosquitto_subscribe(m, NULL, TOPIC_MAIN_DOOR_BUZZER_DONE, 1);
+	if (ret) {
+		fprintf(stderr, "Error could not subscribe to %s: %d\n", TOPIC_MAIN_DOOR_BUZZER_DONE, ret);
+		exit(1);
+	}
+
+	ret = mosquitto_subscribe(m, NULL, TOPIC_GLASS_DOOR_BUZZER_DONE, 1);
+	if (ret) {
+		fprintf(stderr, "Error could not subscribe to %s: %d\n", TOPIC_GLASS_DOOR_BUZZER_DONE, ret);
+		exit(1);
+	}
 }
 
 static void on_disconnect(struct mosquitto *m, void *data, int res) {
@@ -454,6 +937,7 @@ static void on_disconnect(struct mosquitto *m, void *data, int res) {
 	enum bus b = mqtt_to_bus_id(m, data);
 
 	fprintf(stderr, "Disconnected from %s MQTT server\n", bus);
+	udata->snapshot_seen[b] = false;
 	set_state(udata, b, STATE_DISCONNECTED, STATE_UNKNOWN);
 	display_state(udata);
 
@@ -461,10 +945,38 @@ static void on_disconnect(struct mosquitto *m, void *data, int res) {
 	alarm(30);
 }
 
+static void on_snapshot_message(struct userdata *udata, enum bus b, const struct mosquitto_message *msg) {
+	struct snapshot snap;
+	const char *cur, *next;
+
+	if (!snapshot_unpack(&snap, msg->payload, msg->payloadlen)) {
+		fprintf(stderr, "Ignored invalid state snapshot\n");
+		return;
+	}
+
+	if (udata->snapshot_seen[b] && !snapshot_is_newer(&udata->snapshot[b], &snap))
+		return;
+
+	udata->snapshot[b] = snap;
+	udata->snapshot_seen[b] = true;
+
+	cur = snapshot_state_str(snap.state);
+	next = snapshot_state_str(snap.next);
+	set_state(udata, b, str2state(cur, strlen(cur)), str2state(next, strlen(next)));
+	display_state(udata);
+}
+
 static void on_message(struct mosquitto *m, void *udata, const struct mosquitto_message *msg) {
 	enum bus b = mqtt_to_bus_id(m, udata);
+	bool snapshot_seen = ((struct userdata *) udata)->snapshot_seen[b];
 
-	if(!strcmp(TOPIC_STATE_CUR, msg->topic)) {
+	if(!strcmp(SNAPSHOT_TOPIC, msg->topic)) {
+		on_snapshot_message(udata, b, msg);
+		return;
+	} else if ((!strcmp(TOPIC_STATE_CUR, msg->topic) || !strcmp(TOPIC_STATE_NEXT, msg->topic)) && snapshot_seen) {
+		/* the snapshot carries the same information atomically */
+		return;
+	} else if(!strcmp(TOPIC_STATE_CUR, msg->topic)) {
 		int curstate = str2state(msg->payload, msg->payloadlen);
 		set_state(udata, b, curstate, -1);
 		display_state(udata);
@@ -475,15 +987,33 @@ static void on_message(struct mosquitto *m, void *udata, const struct mosquitto_
 		display_state(udata);
 		return;
 	} else if (!strcmp(TOPIC_BOLT_STATE, msg->topic) && msg->payloadlen) {
+		pthread_mutex_lock(&mutex);
 		((struct userdata *) udata)->bolt = ((char*) msg->payload)[0] == '1';
+		pthread_mutex_unlock(&mutex);
 		display_state(udata);
 		return;
 	} else if (!strcmp(TOPIC_MAIN_DOOR_BUZZER, msg->topic) && msg->payloadlen) {
-		((struct userdata *) udata)->buzzer_maindoor = ((char*) msg->payload)[0] == '1';
+		pthread_mutex_lock(&mutex);
+		((struct userdata *) udata)->buzzer_maindoor = ((char*) msg->payload)[0] != '0';
+		pthread_mutex_unlock(&mutex);
 		display_state(udata);
 		return;
 	} else if (!strcmp(TOPIC_GLASS_DOOR_BUZZER, msg->topic) && msg->payloadlen) {
-		((struct userdata *) udata)->buzzer_glassdoor = ((char*) msg->payload)[0] == '1';
+		pthread_mutex_lock(&mutex);
+		((struct userdata *) udata)->buzzer_glassdoor = ((char*) msg->payload)[0] != '0';
+		pthread_mutex_unlock(&mutex);
+		display_state(udata);
+		return;
+	} else if (!strcmp(TOPIC_MAIN_DOOR_BUZZER_DONE, msg->topic)) {
+		pthread_mutex_lock(&mutex);
+		((struct userdata *) udata)->buzzer_maindoor = false;
+		pthread_mutex_unlock(&mutex);
+		display_state(udata);
+		return;
+	} else if (!strcmp(TOPIC_GLASS_DOOR_BUZZER_DONE, msg->topic)) {
+		pthread_mutex_lock(&mutex);
+		((struct userdata *) udata)->buzzer_glassdoor = false;
+		pthread_mutex_unlock(&mutex);
 		display_state(udata);
 		return;
 	}
@@ -666,16 +1196,26 @@ int main(int argc, char **argv) {
 	char *statedir = cfg_get_default(cfg, "statedir", STATEDIR);
 	int i2c_busid = cfg_get_int_default(cfg, "i2c-leds-bus", I2C_LEDS_BUS);
 	int i2c_devid = cfg_get_int_default(cfg, "i2c-leds-dev", I2C_LEDS_DEV);
+	int i2c_burst = cfg_get_int_default(cfg, "i2c-leds-burst", I2C_LEDS_BURST);
+	int i2c_verify = cfg_get_int_default(cfg, "i2c-leds-verify", I2C_LEDS_VERIFY);
+	char *scene_file = cfg_get_default(cfg, "i2c-leds-scene", I2C_LEDS_SCENE);
+	int i2c_segments = cfg_get_int_default(cfg, "i2c-leds-segments", I2C_LEDS_SEGMENTS);
 	cfg_close(cfg);
 
 	char *status_file, *status_next_file;
 
-	udata = malloc(sizeof(*udata));
+	if (scene_load(scene_file)) {
+		fprintf(stderr, "Could not load LED scene\n");
+		return 1;
+	}
+
+	udata = calloc(1, sizeof(*udata));
 	if(!udata) {
 		printf("out of memory!\n");
 		return 1;
 	}
 	globaldata = udata;
+	udata->burst = 1;
 
 	/* initial state unknown */
 	set_state(udata, LOCAL, STATE_UNKNOWN, STATE_UNKNOWN);
@@ -701,9 +1241,21 @@ int main(int argc, char **argv) {
 		return 1;
 	}
 
-	ret = gpio_init(&modegpio);
+	udata->i2c_addr = i2c_devid;
+	udata->burst = i2c_burst < 1 ? 1 : i2c_burst;
+	udata->verify = i2c_verify;
+	udata->segments = i2c_segments;
+	udata->plain = i2c_plain_supported(udata->i2c);
+	if (udata->burst > LED_BLOCK_MAX && !udata->plain) {
+		fprintf(stderr, "I2C adapter is SMBus only, limiting bursts to %d LEDs\n", LED_BLOCK_MAX);
+		udata->burst = LED_BLOCK_MAX;
+	}
+
+	pthread_t renderer;
+	ret = pthread_create(&renderer, NULL, render_thread, udata);
 	if (ret) {
-		fprintf(stderr, "Could not open mode gpio: %d\n", ret);
+		fprintf(stderr, "Could not start render thread: %d\n", ret);
+		return 1;
 	}
 
 	ret = asprintf(&status_file, "%s/status", statedir);
@@ -2,40 +2,36 @@
 #include <sys/stat.h>
 #include <fcntl.h>
 #include <unistd.h>
-#include <linux/i2c-dev.h>
 #include <stdio.h>
 #include <errno.h>
 #include <stdbool.h>
 #include <stdint.h>
 #include <stdlib.h>
 #include <string.h>
+#include <time.h>
 #include <arpa/inet.h>
 
-int i2c_open(int bus, int dev) {
-	int file;
-	char filename[20];
-  
-	sprintf(filename,"/dev/i2c-%d", bus);
-	if ((file = open(filename,O_RDWR)) < 0)
-		return -errno;
-	
-	if (ioctl(file, I2C_SLAVE, dev) < 0)
-		return -errno;
-	
-	return file;
-}
+#include "../common/i2c.h"
 
-int i2c_close(int file) {
-	return close(file);
-}
+/* LEDs in the chain and LEDs with their own register, see tiny-led-firmware */
+#define LED_COUNT 50
+#define LED_REGS 36
+#define LED_REG_CHECKSUM 0xfe
+
+#define LED_REG_SEGMENT 0xc0
+#define LED_REG_SEGDEF 0xe0
+#define LED_SEGMENTS 8
+
+#define BENCH_LEDS 34
+#define BENCH_ROUNDS 20
 
 static bool led_get(int fd, uint8_t i, uint32_t *val) {
 	uint32_t readval;
 	int retries, err;
 
 	for(retries = 0; retries < 3; retries++) {
-		err = i2c_smbus_read_i2c_block_data(fd, i, 4, (uint8_t*) &readval);
-		if (err == -1)
+		err = i2c_read_block(fd, i, 4, (uint8_t*) &readval);
+		if (err < 0)
 			continue;
 		*val = ntohl(readval);
 		return true;
@@ -62,12 +58,12 @@ static bool led_set(int fd, uint8_t i, uint32_t val) {
 	int retries, err;
 
 	for(retries = 0; retries < 5; retries++) {
-		err = i2c_smbus_write_i2c_block_data(fd, i, 4, (uint8_t*) &beval);
-		if (err == -1)
+		err = i2c_write_block(fd, i, 4, (uint8_t*) &beval);
+		if (err < 0)
 			continue;
 		usleep(1000);
-		err = i2c_smbus_read_i2c_block_data(fd, i, 4, (uint8_t*) &readval);
-		if (err == -1)
+		err = i2c_read_block(fd, i, 4, (uint8_t*) &readval);
+		if (err < 0)
 			continue;
 		readval = ntohl(readval);
 		if ((val & 0xffffffc0) == (readval & 0xffffffc0))
@@ -78,20 +74,111 @@ static bool led_set(int fd, uint8_t i, uint32_t val) {
 	return false;
 }
 
+/* Fletcher-16 of count LEDs with the same value, see tiny-led-firmware */
+static uint16_t led_checksum(uint32_t val, int count) {
+	uint16_t sum1 = 0, sum2 = 0;
+	int i, j;
+
+	for(i=0; i < count; i++) {
+		for(j=24; j >= 0; j -= 8) {
+			sum1 = (sum1 + ((val >> j) & 0xff)) % 255;
+			sum2 = (sum2 + sum1) % 255;
+		}
+	}
+
+	return (sum2 << 8) | sum1;
+}
+
+/* removes all segments, every LED shows its own register again */
+static void segments_clear(int fd) {
+	uint8_t buf[LED_SEGMENTS * 4] = {};
+
+	if (i2c_write_block(fd, LED_REG_SEGDEF, sizeof(buf), buf) < 0)
+		printf("failed to clear segments!\n");
+}
+
+/* one segment over the whole chain, a single write and one checksum read */
 static void led_all(int fd, uint32_t val) {
+	uint32_t beval = htonl(val);
+	uint8_t segdef[4] = { 0, LED_COUNT, 0, 0 };
+	uint8_t sumlen[4] = { LED_REGS, 0, 0, 0 };
+	uint8_t sum[2];
 	int i;
+
 	led_set(fd, 0xff, 0xffffffff);
-	for(i=0; i<50; i++)
-		led_set(fd, i, val);
+
+	if (i2c_write_block(fd, LED_REG_SEGDEF, sizeof(segdef), segdef) < 0 ||
+	    i2c_write_block(fd, LED_REG_SEGMENT, 4, (uint8_t*) &beval) < 0)
+		printf("failed to write segment!\n");
+
+	if (i2c_write_block(fd, LED_REG_CHECKSUM, sizeof(sumlen), sumlen) < 0 ||
+	    i2c_read_block(fd, LED_REG_CHECKSUM, sizeof(sum), sum) < 0 ||
+	    ((sum[0] << 8) | sum[1]) != led_checksum(val, LED_REGS)) {
+		printf("checksum mismatch, checking every LED\n");
+		segments_clear(fd);
+		for(i=0; i < LED_REGS; i++)
+			led_set(fd, i, val);
+	}
+
 	led_set(fd, 0xff, 0x00000000);
+}
+
+static uint64_t now_us() {
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t) ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+/* full repaint, burst LEDs per transaction; returns the transaction count */
+static int bench_repaint(int fd, uint32_t val, int burst) {
+	uint8_t buf[BENCH_LEDS * 4];
+	uint32_t beval = htonl(val);
+	int i, n, err, count = 0;
+
+	for(i=0; i < BENCH_LEDS; i++)
+		memcpy(buf + 4 * i, &beval, 4);
+
+	for(i=0; i < BENCH_LEDS; i += n) {
+		n = (BENCH_LEDS - i < burst) ? BENCH_LEDS - i : burst;
+		if (4 * n <= 32)
+			err = i2c_write_block(fd, i, 4 * n, buf + 4 * i);
+		else
+			err = i2c_write_raw(fd, i, 4 * n, buf + 4 * i);
+		if (err < 0)
+			fprintf(stderr, "write of %d LEDs at %d failed: %d\n", n, i, err);
+		count++;
+	}
 
+	return count;
+}
+
+/* bus time of a full repaint with per-LED, SMBus block and plain writes */
+static void bench(int fd, uint32_t val) {
+	static const int bursts[] = { 1, 8, BENCH_LEDS };
+	uint64_t start;
+	int i, r, count;
+
+	for(i=0; i < sizeof(bursts) / sizeof(bursts[0]); i++) {
+		if (bursts[i] > 8 && !i2c_plain_supported(fd)) {
+			printf("burst %2d: adapter is SMBus only\n", bursts[i]);
+			continue;
+		}
+
+		start = now_us();
+		for(r=0; r < BENCH_ROUNDS; r++)
+			count = bench_repaint(fd, val, bursts[i]);
+
+		printf("burst %2d: %d transactions, %llu us per repaint\n", bursts[i], count,
+			(unsigned long long) (now_us() - start) / BENCH_ROUNDS);
+	}
 }
 
 int main(int argc, char **argv) {
 	if (argc < 4) {
 		fprintf(stderr, "%s <i2c-dev> <led> <color>\n", argv[0]);
 		fprintf(stderr, "\ti2c-dev: 1 for /dev/i2c-1\n");
-		fprintf(stderr, "\tled:     id or \"all\"\n");
+		fprintf(stderr, "\tled:     id (clears segments), \"all\" or \"bench\" (time a full repaint)\n");
 		fprintf(stderr, "\tcolor:   0xRRGGBBcc\n");
 		return 1;
 	}
@@ -108,8 +195,12 @@ int main(int argc, char **argv) {
 
 	if (!strcmp(argv[2], "all"))
 		led_all(fd, val);
-	else
+	else if (!strcmp(argv[2], "bench"))
+		bench(fd, val);
+	else {
+		segments_clear(fd);
 		led_set(fd, led, val);
+	}
 
 	i2c_close(fd);
 }
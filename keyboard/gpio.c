@@ -32,6 +32,7 @@
 #include <linux/gpio.h>
 
 #include "gpio.h"
+#include "../common/hwsim.h"
 
 static inline int check_prefix(const char *str, const char *prefix) {
         return strlen(str) > strlen(prefix) &&
@@ -47,7 +48,7 @@ char *symlink_fname(const char *link) {
 		return NULL;
 
 	s = readlink(link, buf, sizeof(buf)-1);
-	if (!s)
+	if (s <= 0)
 		return NULL;
 	buf[s] = '\0';
 	
@@ -68,7 +69,7 @@ char *chip2dev(const char *chipdev) {
 	asprintf(&path, "/sys/bus/gpio/devices/%s", chipdev);
 	s = readlink(path, buf, sizeof(buf)-1);
 	free(path);
-	if (!s)
+	if (s <= 0)
 		return NULL;
 	buf[s] = '\0';
 
@@ -94,91 +95,247 @@ char *chip2dev(const char *chipdev) {
 	return NULL;
 }
 
-char* find_gpio_dev(char *dev) {
+struct gpiochip {
+	char *label;
+	char *path;
+};
+
+static struct gpiochip chips[GPIO_CHIPS_MAX];
+static int chip_count = -1;
+static bool chips_scanned = false;
+
+static void gpio_chips_free() {
+	int i;
+
+	for (i = 0; i < chip_count; i++) {
+		free(chips[i].label);
+		free(chips[i].path);
+	}
+	chip_count = 0;
+}
+
+/* the cache is valid until a chip appears in or vanishes from /dev */
+static bool gpio_chips_load() {
+	struct stat cache, dev;
+	char label[256], path[256];
+	FILE *f;
+
+	if (stat(GPIO_CHIP_CACHE, &cache) || stat("/dev", &dev))
+		return false;
+	if (cache.st_mtime < dev.st_mtime)
+		return false;
+
+	f = fopen(GPIO_CHIP_CACHE, "r");
+	if (!f)
+		return false;
+
+	chip_count = 0;
+	while (chip_count < GPIO_CHIPS_MAX && fscanf(f, "%255s %255s", label, path) == 2) {
+		chips[chip_count].label = strdup(label);
+		chips[chip_count].path = strdup(path);
+		chip_count++;
+	}
+
+	fclose(f);
+	return chip_count > 0;
+}
+
+/* written atomically, other daemons may read it concurrently */
+static void gpio_chips_save() {
+	char *tmp;
+	FILE *f;
+	int i;
+
+	if (asprintf(&tmp, "%s.%d", GPIO_CHIP_CACHE, getpid()) < 0)
+		return;
+
+	f = fopen(tmp, "w");
+	if (!f) {
+		free(tmp);
+		return;
+	}
+
+	for (i = 0; i < chip_count; i++)
+		fprintf(f, "%s %s\n", chips[i].label, chips[i].path);
+
+	if (fclose(f) || rename(tmp, GPIO_CHIP_CACHE))
+		unlink(tmp);
+	free(tmp);
+}
+
+/* gpio-sim banks are matched by the label configured in configfs */
+static char *chip_label(const char *chipdev) {
+	struct gpiochip_info info;
+	char *path;
+	int fd;
+
+	if (asprintf(&path, "/dev/%s", chipdev) < 0)
+		return NULL;
+	fd = open(path, O_RDONLY | O_CLOEXEC);
+	free(path);
+	if (fd < 0)
+		return NULL;
+
+	memset(&info, 0, sizeof(info));
+	if (ioctl(fd, GPIO_GET_CHIPINFO_IOCTL, &info) < 0) {
+		close(fd);
+		return NULL;
+	}
+
+	close(fd);
+	return strdup(info.label);
+}
+
+static void gpio_chips_scan() {
 	const struct dirent *ent;
-	char *desc;
-	DIR *dp = opendir("/dev");
+	char *label, *path;
+	DIR *dp;
+
+	chip_count = 0;
+	chips_scanned = true;
+
+	dp = opendir("/dev");
 	if (!dp)
-		return NULL;
+		return;
 
-	while (ent = readdir(dp), ent) {
-		if (check_prefix(ent->d_name, "gpiochip")) {
-			desc = chip2dev(ent->d_name);
-			if (strcmp(dev, desc) == 0) {
-				free(desc);
-				asprintf(&desc, "/dev/%s", ent->d_name);
-				return desc;
-			}
-			free(desc);
+	while ((ent = readdir(dp)) && chip_count < GPIO_CHIPS_MAX) {
+		if (!check_prefix(ent->d_name, "gpiochip"))
+			continue;
+
+		if (hw_backend() == HW_BACKEND_GPIO_SIM)
+			label = chip_label(ent->d_name);
+		else
+			label = chip2dev(ent->d_name);
+		if (!label)
+			continue;
+
+		if (asprintf(&path, "/dev/%s", ent->d_name) < 0) {
+			free(label);
+			continue;
 		}
+
+		chips[chip_count].label = label;
+		chips[chip_count].path = path;
+		chip_count++;
 	}
 
+	closedir(dp);
+
+	if (hw_backend() == HW_BACKEND_KERNEL)
+		gpio_chips_save();
+}
+
+static const char *gpio_chips_lookup(const char *dev) {
+	int i;
+
+	for (i = 0; i < chip_count; i++)
+		if (!strcmp(chips[i].label, dev))
+			return chips[i].path;
+
 	return NULL;
 }
 
-int gpio_init(struct gpiodesc *gpio) {
-	char *dev = find_gpio_dev(gpio->dev);
-	if (!dev)
-		return -ENODEV;
+/*
+ * Resolves a "subsystem/device" label to its /dev/gpiochipN node. All chips
+ * are enumerated once per process (or taken from the cache in /run) and
+ * rescanned only if a label is unknown, e.g. because a driver loaded late.
+ */
+char* find_gpio_dev(char *dev) {
+	const char *path;
 
-	gpio->fd = open(dev, 0);
-	free(dev);
+	if (chip_count < 0 && (hw_backend() != HW_BACKEND_KERNEL || !gpio_chips_load()))
+		gpio_chips_scan();
 
-	if (gpio->fd < 0)
-		return -errno;
+	path = gpio_chips_lookup(dev);
+	if (!path && !chips_scanned) {
+		gpio_chips_free();
+		gpio_chips_scan();
+		path = gpio_chips_lookup(dev);
+	}
 
+	return path ? strdup(path) : NULL;
+}
 
-	if (gpio->direction == GPIO_INPUT) {
-		struct gpioevent_request req = {0};
+static int gpio_open_chip(const char *name) {
+	char *dev = find_gpio_dev((char *) name);
+	int fd;
 
-		req.lineoffset = gpio->offset;
-		strncpy(req.consumer_label, gpio->name, 31);
+	if (!dev)
+		return -ENODEV;
 
-		req.handleflags = GPIOHANDLE_REQUEST_INPUT;
-		if (gpio->flags & GPIO_ACTIVE_LOW)
-			req.handleflags |= GPIOHANDLE_REQUEST_ACTIVE_LOW;
+	fd = open(dev, O_RDONLY | O_CLOEXEC);
+	free(dev);
 
-		req.eventflags = GPIOEVENT_REQUEST_BOTH_EDGES;
+	if (fd < 0)
+		return -errno;
 
-		int err = ioctl(gpio->fd, GPIO_GET_LINEEVENT_IOCTL, &req);
-		if (err < 0) {
-			close(gpio->fd);
-			return -errno;
-		}
+	return fd;
+}
 
-		gpio->evfd = req.fd;
-	} else {
-		struct gpiohandle_request req = {0};
+static uint64_t gpio_line_flags(struct gpiodesc *gpio) {
+	uint64_t flags;
 
-		req.lines = 1;
-		req.lineoffsets[0] = gpio->offset;
-		strncpy(req.consumer_label, gpio->name, 31);
+	if (gpio->direction == GPIO_INPUT)
+		flags = GPIO_V2_LINE_FLAG_INPUT | GPIO_V2_LINE_FLAG_EDGE_RISING | GPIO_V2_LINE_FLAG_EDGE_FALLING;
+	else
+		flags = GPIO_V2_LINE_FLAG_OUTPUT;
 
-		req.flags = GPIOHANDLE_REQUEST_OUTPUT;
-		if (gpio->flags & GPIO_ACTIVE_LOW)
-			req.flags |= GPIOHANDLE_REQUEST_ACTIVE_LOW;
+	if (gpio->flags & GPIO_ACTIVE_LOW)
+		flags |= GPIO_V2_LINE_FLAG_ACTIVE_LOW;
 
-		if (gpio->flags & GPIO_DEFAULT_SET)
-			req.default_values[0] = 1;
-		else
-			req.default_values[0] = 0;
+	return flags;
+}
 
-		int err = ioctl(gpio->fd, GPIO_GET_LINEHANDLE_IOCTL, &req);
-		if (err < 0) {
-			close(gpio->fd);
-			return -errno;
-		}
+int gpio_init(struct gpiodesc *gpio) {
+	struct gpio_v2_line_request req;
+	uint32_t offset = gpio->offset;
+
+	if (hw_backend() == HW_BACKEND_SIM) {
+		gpio->fd = -1;
+		gpio->evfd = hwsim_gpio_request(gpio->dev, &offset, 1, gpio->direction == GPIO_OUTPUT,
+						(gpio->flags & GPIO_DEFAULT_SET) ? 1 : 0);
+		return gpio->evfd < 0 ? gpio->evfd : 0;
+	}
 
-		gpio->evfd = req.fd;
+	gpio->fd = gpio_open_chip(gpio->dev);
+	if (gpio->fd < 0)
+		return gpio->fd;
+
+	memset(&req, 0, sizeof(req));
+	req.offsets[0] = gpio->offset;
+	req.num_lines = 1;
+	strncpy(req.consumer, gpio->name, sizeof(req.consumer) - 1);
+	req.config.flags = gpio_line_flags(gpio);
+
+	if (gpio->direction == GPIO_OUTPUT) {
+		req.config.num_attrs = 1;
+		req.config.attrs[0].attr.id = GPIO_V2_LINE_ATTR_ID_OUTPUT_VALUES;
+		req.config.attrs[0].attr.values = (gpio->flags & GPIO_DEFAULT_SET) ? 1 : 0;
+		req.config.attrs[0].mask = 1;
+	}
+
+	if (ioctl(gpio->fd, GPIO_V2_GET_LINE_IOCTL, &req) < 0) {
+		int err = -errno;
+		close(gpio->fd);
+		gpio->fd = -1;
+		return err;
 	}
 
+	gpio->evfd = req.fd;
+
 	return 0;
 }
 
 int gpio_write(struct gpiodesc *gpio, bool value) {
-	struct gpiohandle_data data;
-	data.values[0] = value;
-	return ioctl(gpio->evfd, GPIOHANDLE_SET_LINE_VALUES_IOCTL, &data);
+	struct gpio_v2_line_values data = {
+		.bits = value,
+		.mask = 1,
+	};
+
+	if (hw_backend() == HW_BACKEND_SIM)
+		return hwsim_gpio_set(gpio->evfd, data.bits, data.mask);
+
+	return ioctl(gpio->evfd, GPIO_V2_LINE_SET_VALUES_IOCTL, &data);
 }
 
 void gpio_close(struct gpiodesc *gpio) {
@@ -186,7 +343,209 @@ void gpio_close(struct gpiodesc *gpio) {
 		return;
 
 	close(gpio->evfd);
-	close(gpio->fd);
+	if (gpio->fd >= 0)
+		close(gpio->fd);
 	gpio->evfd = -1;
 	gpio->fd = -1;
 }
+
+/*
+ * Sort an input line into the group of its chip. The groups array must be
+ * zero initialized, unused entries have no dev. Returns the group index.
+ */
+int gpio_group_add(struct gpiogroup *groups, int max, struct gpiodesc *gpio, int id, unsigned int debounce) {
+	struct gpiogroup *group;
+	int i;
+
+	if (gpio->direction != GPIO_INPUT)
+		return -EINVAL;
+
+	for (i = 0; i < max && groups[i].dev; i++)
+		if (!strcmp(groups[i].dev, gpio->dev))
+			break;
+
+	if (i == max)
+		return -ENOSPC;
+
+	group = &groups[i];
+	if (!group->dev) {
+		group->dev = gpio->dev;
+		group->fd = -1;
+		group->evfd = -1;
+	}
+
+	if (group->count == GPIO_GROUP_MAX_LINES)
+		return -ENOSPC;
+
+	group->lines[group->count] = gpio;
+	group->ids[group->count] = id;
+	group->debounce[group->count] = debounce;
+	group->count++;
+
+	return i;
+}
+
+static int gpio_group_ioctl(struct gpiogroup *group, bool debounce) {
+	struct gpio_v2_line_request req;
+	struct gpio_v2_line_config *cfg = &req.config;
+	unsigned int i, j;
+
+	memset(&req, 0, sizeof(req));
+	req.num_lines = group->count;
+	strncpy(req.consumer, group->lines[0]->name, sizeof(req.consumer) - 1);
+
+	for (i = 0; i < group->count; i++) {
+		req.offsets[i] = group->lines[i]->offset;
+
+		/* the line config is the default, differing lines get an attribute */
+		if (!i) {
+			cfg->flags = gpio_line_flags(group->lines[i]);
+			continue;
+		}
+
+		if (gpio_line_flags(group->lines[i]) == cfg->flags)
+			continue;
+
+		for (j = 0; j < cfg->num_attrs; j++) {
+			if (cfg->attrs[j].attr.id == GPIO_V2_LINE_ATTR_ID_FLAGS &&
+			    cfg->attrs[j].attr.flags == gpio_line_flags(group->lines[i]))
+				break;
+		}
+
+		if (j == cfg->num_attrs) {
+			if (j == GPIO_V2_LINE_NUM_ATTRS_MAX)
+				return -E2BIG;
+			cfg->attrs[j].attr.id = GPIO_V2_LINE_ATTR_ID_FLAGS;
+			cfg->attrs[j].attr.flags = gpio_line_flags(group->lines[i]);
+			cfg->num_attrs++;
+		}
+		cfg->attrs[j].mask |= 1ULL << i;
+	}
+
+	for (i = 0; debounce && i < group->count; i++) {
+		if (!group->debounce[i])
+			continue;
+
+		for (j = 0; j < cfg->num_attrs; j++) {
+			if (cfg->attrs[j].attr.id == GPIO_V2_LINE_ATTR_ID_DEBOUNCE &&
+			    cfg->attrs[j].attr.debounce_period_us == group->debounce[i] * 1000)
+				break;
+		}
+
+		if (j == cfg->num_attrs) {
+			if (j == GPIO_V2_LINE_NUM_ATTRS_MAX)
+				return -E2BIG;
+			cfg->attrs[j].attr.id = GPIO_V2_LINE_ATTR_ID_DEBOUNCE;
+			cfg->attrs[j].attr.debounce_period_us = group->debounce[i] * 1000;
+			cfg->num_attrs++;
+		}
+		cfg->attrs[j].mask |= 1ULL << i;
+	}
+
+	if (ioctl(group->fd, GPIO_V2_GET_LINE_IOCTL, &req) < 0)
+		return -errno;
+
+	group->evfd = req.fd;
+	return 0;
+}
+
+/* one line request for all lines of the group */
+int gpio_group_request(struct gpiogroup *group) {
+	uint32_t offsets[GPIO_GROUP_MAX_LINES];
+	unsigned int i;
+	int err;
+
+	/* simulated lines do not bounce, but the software debouncer is tested */
+	if (hw_backend() == HW_BACKEND_SIM) {
+		for (i = 0; i < group->count; i++)
+			offsets[i] = group->lines[i]->offset;
+
+		group->debounced = false;
+		group->evfd = hwsim_gpio_request(group->dev, offsets, group->count, false, 0);
+		return group->evfd < 0 ? group->evfd : 0;
+	}
+
+	group->fd = gpio_open_chip(group->dev);
+	if (group->fd < 0)
+		return group->fd;
+
+	/* not every chip can debounce, the caller has to do it then */
+	err = gpio_group_ioctl(group, true);
+	group->debounced = !err;
+	if (err)
+		err = gpio_group_ioctl(group, false);
+
+	if (err) {
+		close(group->fd);
+		group->fd = -1;
+		return err;
+	}
+
+	return 0;
+}
+
+/*
+ * Reads all pending edges with a single read(). The per line sequence
+ * numbers reveal events the kernel dropped because its FIFO overflowed.
+ * Returns the number of edges or a negative error code.
+ */
+int gpio_group_read(struct gpiogroup *group, struct gpio_edge *edges, int max) {
+	struct gpio_v2_line_event events[GPIO_GROUP_MAX_EVENTS];
+	ssize_t len;
+	int i, n, count = 0;
+	unsigned int line;
+
+	if (max > GPIO_GROUP_MAX_EVENTS)
+		max = GPIO_GROUP_MAX_EVENTS;
+
+	len = read(group->evfd, events, max * sizeof(events[0]));
+	if (len < 0)
+		return -errno;
+
+	n = len / sizeof(events[0]);
+	for (i = 0; i < n; i++) {
+		for (line = 0; line < group->count; line++)
+			if (group->lines[line]->offset == events[i].offset)
+				break;
+		if (line == group->count)
+			continue;
+
+		edges[count].id = group->ids[line];
+		edges[count].value = events[i].id == GPIO_V2_LINE_EVENT_RISING_EDGE;
+		edges[count].timestamp = events[i].timestamp_ns;
+		edges[count].lost = 0;
+		if (group->line_seqno[line] && events[i].line_seqno > group->line_seqno[line] + 1)
+			edges[count].lost = events[i].line_seqno - group->line_seqno[line] - 1;
+		group->line_seqno[line] = events[i].line_seqno;
+		count++;
+	}
+
+	return count;
+}
+
+/* current level of all lines with one ioctl, bit i is group->lines[i] */
+int gpio_group_values(struct gpiogroup *group, uint64_t *values) {
+	struct gpio_v2_line_values data = {
+		.mask = (group->count < 64) ? (1ULL << group->count) - 1 : ~0ULL,
+	};
+
+	if (hw_backend() == HW_BACKEND_SIM)
+		return hwsim_gpio_get(group->evfd, data.mask, values);
+
+	if (ioctl(group->evfd, GPIO_V2_LINE_GET_VALUES_IOCTL, &data) < 0)
+		return -errno;
+
+	*values = data.bits;
+	return 0;
+}
+
+void gpio_group_close(struct gpiogroup *group) {
+	if (!group)
+		return;
+
+	close(group->evfd);
+	if (group->fd >= 0)
+		close(group->fd);
+	group->evfd = -1;
+	group->fd = -1;
+}
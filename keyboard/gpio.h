@@ -27,8 +27,42 @@ struct gpiodesc {
 	int evfd;
 };
 
+#define GPIO_CHIP_CACHE "/run/acs-gpiochips"
+#define GPIO_CHIPS_MAX 16
+
+#define GPIO_GROUP_MAX_LINES 16
+#define GPIO_GROUP_MAX_EVENTS 16
+
+/* input lines of one chip, requested at once and sharing one event fd */
+struct gpiogroup {
+	char *dev;
+	unsigned int count;
+	struct gpiodesc *lines[GPIO_GROUP_MAX_LINES];
+	int ids[GPIO_GROUP_MAX_LINES];
+	unsigned int debounce[GPIO_GROUP_MAX_LINES];
+
+	/* private */
+	int fd;
+	int evfd;
+	bool debounced;
+	uint32_t line_seqno[GPIO_GROUP_MAX_LINES];
+};
+
+struct gpio_edge {
+	int id;
+	bool value;
+	uint64_t timestamp;
+	uint32_t lost;
+};
+
 int gpio_init(struct gpiodesc *gpio);
 int gpio_write(struct gpiodesc *gpio, bool value);
 void gpio_close(struct gpiodesc *gpio);
 
+int gpio_group_add(struct gpiogroup *groups, int max, struct gpiodesc *gpio, int id, unsigned int debounce);
+int gpio_group_request(struct gpiogroup *group);
+int gpio_group_read(struct gpiogroup *group, struct gpio_edge *edges, int max);
+int gpio_group_values(struct gpiogroup *group, uint64_t *values);
+void gpio_group_close(struct gpiogroup *group);
+
 #endif
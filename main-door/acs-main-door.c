@@ -24,11 +24,19 @@
 #include <stdlib.h>
 #include <signal.h>
 #include "../common/config.h"
+#include "../common/mqtt.h"
+#include "../common/localbus.h"
+#include "../common/trace.h"
 
 #define TOPIC_BELL_BUTTON "/access-control-system/main-door/bell-button"
+#define TOPIC_BELL_BUTTON_TRACE TOPIC_BELL_BUTTON TRACE_SUFFIX
 #define TOPIC_REED_SWITCH "/access-control-system/main-door/reed-switch"
 #define TOPIC_BUZZER "/access-control-system/main-door/buzzer"
 #define TOPIC_BELL "/access-control-system/bell"
+
+/* acs-gpio-actor switches the output off again on its own */
+#define PULSE_BUZZER "pulse:3000"
+#define PULSE_BELL "pulse:1000"
 #define TOPIC_STATE "/access-control-system/space-state"
 
 const static char* states[] = {
@@ -65,16 +73,23 @@ struct userdata {
 	enum event eventinprogress;
 	bool cached_reed_state;
 	enum states2 state;
+
+	/* latency trace of the last bell button edge */
+	struct trace trace;
 };
 
 #define GPIO_TIMEOUT 60 * 1000
 
 struct userdata *globaludata;
 
+static struct mqtt_session session;
+static struct localbus local;
+
 static void on_connect(struct mosquitto *m, void *udata, int res) {
 	int ret;
 
 	fprintf(stderr, "Connected.\n");
+	mqtt_session_connected(&session, res);
 
 	ret = mosquitto_subscribe(m, NULL, TOPIC_REED_SWITCH, 1);
 	if (ret) {
@@ -93,14 +108,19 @@ static void on_connect(struct mosquitto *m, void *udata, int res) {
 		fprintf(stderr, "MQTT Error: Could not subscribe to %s: %d\n", TOPIC_STATE, ret);
 		exit(1);
 	}
+
+	ret = mosquitto_subscribe(m, NULL, TOPIC_BELL_BUTTON_TRACE, 0);
+	if (ret) {
+		fprintf(stderr, "MQTT Error: Could not subscribe to %s: %d\n", TOPIC_BELL_BUTTON_TRACE, ret);
+		exit(1);
+	}
 }
 
 static void on_disconnect(struct mosquitto *m, void *data, int res) {
 	struct userdata *udata = (struct userdata*) data;
 
 	fprintf(stderr, "MQTT Disconnected.\n");
-
-	exit(1);
+	mqtt_session_disconnected(&session, res);
 }
 
 static void on_subscribe(struct mosquitto *m, void *udata, int mid, int qos_count, const int *granted_qos) {
@@ -143,6 +163,26 @@ static void on_reed_message(struct mosquitto *m, void *data, const struct mosqui
 	udata->cached_reed_state = state;
 }
 
+static void on_trace_message(struct mosquitto *m, void *data, const struct mosquitto_message *msg) {
+	struct userdata *udata = (struct userdata*) data;
+
+	if (!trace_unpack(&udata->trace, msg->payload, msg->payloadlen))
+		udata->trace.hops = 0;
+}
+
+/* forward the bell button trace with our own stamp, must precede the action */
+static void forward_trace(struct mosquitto *m, struct userdata *udata, const char *topic) {
+	uint8_t buf[TRACE_MAX_SIZE];
+	int len;
+
+	if (trace_fresh(&udata->trace) && trace_hop(&udata->trace)) {
+		len = trace_pack(&udata->trace, buf, sizeof(buf));
+		mqtt_publish_volatile(&session, topic, len, buf, 0);
+	}
+
+	udata->trace.hops = 0;
+}
+
 static void on_button_message(struct mosquitto *m, void *data, const struct mosquitto_message *msg) {
 	struct userdata *udata = (struct userdata*) data;
 
@@ -166,12 +206,14 @@ static void on_button_message(struct mosquitto *m, void *data, const struct mosq
 	if (udata->state == STATE_OPEN_PLUS) {
 		/* trigger buzzer */
 		udata->eventinprogress = EVENT_BUZZER;
-		mosquitto_publish(m, NULL, TOPIC_BUZZER, 2, "1", 0, true);
+		forward_trace(m, udata, TOPIC_BUZZER TRACE_SUFFIX);
+		mqtt_publish_volatile(&session, TOPIC_BUZZER, sizeof(PULSE_BUZZER), PULSE_BUZZER, 0);
 		alarm(3);
 	} else {
 		/* ring the bell */
 		udata->eventinprogress = EVENT_BELL;
-		mosquitto_publish(m, NULL, TOPIC_BELL, 2, "1", 0, true);
+		forward_trace(m, udata, TOPIC_BELL TRACE_SUFFIX);
+		mqtt_publish_volatile(&session, TOPIC_BELL, sizeof(PULSE_BELL), PULSE_BELL, 0);
 		alarm(1);
 	}
 }
@@ -224,24 +266,26 @@ static void on_message(struct mosquitto *m, void *data, const struct mosquitto_m
 		return;
 	}
 
+	/* latency trace of the bell button */
+	if(!strcmp(TOPIC_BELL_BUTTON_TRACE, msg->topic)) {
+		on_trace_message(m, data, msg);
+		return;
+	}
+
 
 	fprintf(stderr, "Ignored message with wrong topic\n");
 	return;
 }
 
+/* the pulse is over, accept the next button press */
 void on_alarm(int signal) {
-	switch (globaludata->eventinprogress) {
-		case EVENT_BELL:
-			mosquitto_publish(globaludata->mosq, NULL, TOPIC_BELL, 2, "0", 0, true);
-			break;
-		case EVENT_BUZZER:
-			mosquitto_publish(globaludata->mosq, NULL, TOPIC_BUZZER, 2, "0", 0, true);
-			break;
-	}
-
 	globaludata->eventinprogress = EVENT_NONE;
 }
 
+static void on_broker_message(struct mosquitto *m, void *data, const struct mosquitto_message *msg) {
+	localbus_dispatch(&local, msg);
+}
+
 int main(int argc, char **argv) {
 	struct mosquitto *mosq;
 	struct userdata udata;
@@ -257,6 +301,9 @@ int main(int argc, char **argv) {
 	char *host = cfg_get_default(cfg, "mqtt-broker-host", MQTT_BROKER_HOST);
 	int port = cfg_get_int_default(cfg, "mqtt-broker-port", MQTT_BROKER_PORT);
 	int keepalv = cfg_get_int_default(cfg, "mqtt-keepalive", MQTT_KEEPALIVE_SECONDS);
+	int delay_min = cfg_get_int_default(cfg, "mqtt-reconnect-delay-min", MQTT_RECONNECT_DELAY_MIN);
+	int delay_max = cfg_get_int_default(cfg, "mqtt-reconnect-delay-max", MQTT_RECONNECT_DELAY_MAX);
+	char *localdir = cfg_get_default(cfg, "localbus-dir", LOCALBUS_DIR);
 	cfg_close(cfg);
 
 	/* create mosquitto client instance */
@@ -273,7 +320,7 @@ int main(int argc, char **argv) {
 	mosquitto_publish_callback_set(mosq, on_publish);
 	mosquitto_subscribe_callback_set(mosq, on_subscribe);
 	mosquitto_log_callback_set(mosq, on_log);
-	mosquitto_message_callback_set(mosq, on_message);
+	mosquitto_message_callback_set(mosq, on_broker_message);
 
 	/* setup credentials */
 	if (strcmp(user, "")) {
@@ -299,7 +346,8 @@ int main(int argc, char **argv) {
 	}
 
 	/* connect to broker */
-	ret = mosquitto_connect(mosq, host, port, keepalv);
+	mqtt_session_init(&session, mosq, delay_min, delay_max);
+	ret = mqtt_session_connect(&session, host, port, keepalv);
 	if (ret) {
 		fprintf(stderr, "Error could not connect to broker: %d\n", ret);
 		return 1;
@@ -307,11 +355,26 @@ int main(int argc, char **argv) {
 
 	/* init udata */
 	udata.eventinprogress = false;
+	udata.trace.hops = 0;
 
 	globaludata = &udata;
 	signal(SIGALRM, on_alarm);
 
-	ret = mosquitto_loop_forever(mosq, -1, 1);
+	/* on-device topics bypass the broker */
+	localbus_init(&local, mosq, &udata, on_message);
+	ret = localbus_open(&local, localdir, "main-door");
+	if (!ret) {
+		ret |= localbus_subscribe(&local, TOPIC_BELL_BUTTON);
+		ret |= localbus_subscribe(&local, TOPIC_BELL_BUTTON_TRACE);
+		ret |= localbus_subscribe(&local, TOPIC_REED_SWITCH);
+		ret |= localbus_start(&local);
+	}
+	if (ret)
+		fprintf(stderr, "Local bus disabled: %d\n", ret);
+	else
+		mqtt_session_set_localbus(&session, &local);
+
+	ret = mqtt_session_loop_forever(&session);
 	if (ret) {
 		fprintf(stderr, "Error could not setup mosquitto network loop: %d\n", ret);
 		return 1;
@@ -28,6 +28,8 @@
 #include <unistd.h>
 #include <sys/inotify.h>
 #include "../common/config.h"
+#include "../common/mqtt.h"
+#include "../common/snapshot.h"
 
 #define TOPIC_KEYHOLDER_ID "/access-control-system/keyholder/id"
 #define TOPIC_KEYHOLDER_NAME "/access-control-system/keyholder/name"
@@ -64,13 +66,17 @@ struct acs_state {
 int ifd; /* inotify file descriptor */
 int wfd; /* directory watch file descriptor */
 
+static struct mqtt_session session;
+static struct snapshot snapshot = { .source = SNAPSHOT_SOURCE_KEYHOLDER };
+
 static void on_connect(struct mosquitto *m, void *udata, int res) {
 	printf("Connected to MQTT.\n");
+	mqtt_session_connected(&session, res);
 }
 
 static void on_disconnect(struct mosquitto *m, void *udata, int res) {
 	fprintf(stderr, "Disconnected from MQTT.\n");
-	exit(1);
+	mqtt_session_disconnected(&session, res);
 }
 
 static void on_publish(struct mosquitto *m, void *udata, int m_id) {
@@ -256,6 +262,17 @@ static void handle_inotify(int fd) {
 	}
 }
 
+static int publish_snapshot(struct acs_state *acss) {
+	uint8_t buf[SNAPSHOT_MAX_SIZE];
+	int len;
+
+	snapshot.seq++;
+	snapshot_set(&snapshot, atoi(acss->keyholder_id), acss->keyholder_name, acss->status, acss->status_next, acss->message);
+	len = snapshot_pack(&snapshot, buf, sizeof(buf));
+
+	return mqtt_publish_retained(&session, SNAPSHOT_TOPIC, len, buf, 0);
+}
+
 static bool open_door(struct mosquitto *mosq, char *door) {
 	int ret;
 
@@ -265,7 +282,7 @@ static bool open_door(struct mosquitto *mosq, char *door) {
 	if (!strcmp(door, "glass")) {
 		printf("door open: glass\n");
 
-		ret = mosquitto_publish(mosq, NULL, TOPIC_BUZZER_GLASS, 2, "1", 0, true);
+		ret = mqtt_publish_retained(&session, TOPIC_BUZZER_GLASS, 2, "1", 0);
 		if (ret) {
 			fprintf(stderr, "Error could not send message: %d\n", ret);
 			return false;
@@ -273,7 +290,7 @@ static bool open_door(struct mosquitto *mosq, char *door) {
 
 		sleep(3);
 
-		ret = mosquitto_publish(mosq, NULL, TOPIC_BUZZER_GLASS, 2, "0", 0, true);
+		ret = mqtt_publish_retained(&session, TOPIC_BUZZER_GLASS, 2, "0", 0);
 		if (ret) {
 			fprintf(stderr, "Error could not send message: %d\n", ret);
 			return false;
@@ -281,7 +298,7 @@ static bool open_door(struct mosquitto *mosq, char *door) {
 	} else if (!strcmp(door, "main")) {
 		printf("door open: main\n");
 
-		ret = mosquitto_publish(mosq, NULL, TOPIC_BUZZER_MAIN, 2, "1", 0, true);
+		ret = mqtt_publish_retained(&session, TOPIC_BUZZER_MAIN, 2, "1", 0);
 		if (ret) {
 			fprintf(stderr, "Error could not send message: %d\n", ret);
 			return false;
@@ -289,7 +306,7 @@ static bool open_door(struct mosquitto *mosq, char *door) {
 
 		sleep(3);
 
-		ret = mosquitto_publish(mosq, NULL, TOPIC_BUZZER_MAIN, 2, "0", 0, true);
+		ret = mqtt_publish_retained(&session, TOPIC_BUZZER_MAIN, 2, "0", 0);
 		if (ret) {
 			fprintf(stderr, "Error could not send message: %d\n", ret);
 			return false;
@@ -331,8 +348,13 @@ int main(int argc, char **argv) {
 	char *user = cfg_get_default(cfg, "mqtt-username", MQTT_USERNAME);
 	char *pass = cfg_get_default(cfg, "mqtt-password", MQTT_PASSWORD);
 	int keepalive = cfg_get_int_default(cfg, "mqtt-keepalive", MQTT_KEEPALIVE_SECONDS);
+	int delay_min = cfg_get_int_default(cfg, "mqtt-reconnect-delay-min", MQTT_RECONNECT_DELAY_MIN);
+	int delay_max = cfg_get_int_default(cfg, "mqtt-reconnect-delay-max", MQTT_RECONNECT_DELAY_MAX);
 	cfg_close(cfg);
 
+	mqtt_session_init(&session, mosq, delay_min, delay_max);
+	snapshot.seq = snapshot_seq_init();
+
 	/* setup callbacks */
 	mosquitto_connect_callback_set(mosq, on_connect);
 	mosquitto_disconnect_callback_set(mosq, on_disconnect);
@@ -364,7 +386,7 @@ int main(int argc, char **argv) {
 	}
 
 	/* connect to broker */
-	ret = mosquitto_connect(mosq, host, port, keepalive);
+	ret = mqtt_session_connect(&session, host, port, keepalive);
 	if (ret) {
 		fprintf(stderr, "Error could not connect to broker: %d\n", ret);
 		return 1;
@@ -390,7 +412,7 @@ int main(int argc, char **argv) {
 	fdset[0].fd = ifd;
 	fdset[0].events = POLLIN;
 
-	ret = mosquitto_loop_start(mosq);
+	ret = mqtt_session_loop_start(&session);
 	if (ret) {
 		fprintf(stderr, "Error could not start mosquitto network loop: %d\n", ret);
 		return 1;
@@ -423,32 +445,38 @@ int main(int argc, char **argv) {
 				printf("  status-next: %s\n", newacss.status_next[0] == '\0' ? "--- unset ---" : newacss.status_next);
 				printf("  message:     %s\n", newacss.message[0] == '\0' ? "--- unset ---" : newacss.message);
 
-				/* publish state */
-				ret = mosquitto_publish(mosq, NULL, TOPIC_KEYHOLDER_ID, strlen(acss.keyholder_id), acss.keyholder_id, 0, true);
+				/* publish state, aggregated first */
+				ret = publish_snapshot(&acss);
+				if (ret) {
+					fprintf(stderr, "Error could not send message: %d\n", ret);
+					return 1;
+				}
+
+				ret = mqtt_publish_retained(&session, TOPIC_KEYHOLDER_ID, strlen(acss.keyholder_id), acss.keyholder_id, 0);
 				if (ret) {
 					fprintf(stderr, "Error could not send message: %d\n", ret);
 					return 1;
 				}
 
-				ret = mosquitto_publish(mosq, NULL, TOPIC_KEYHOLDER_NAME, strlen(acss.keyholder_name), acss.keyholder_name, 0, true);
+				ret = mqtt_publish_retained(&session, TOPIC_KEYHOLDER_NAME, strlen(acss.keyholder_name), acss.keyholder_name, 0);
 				if (ret) {
 					fprintf(stderr, "Error could not send message: %d\n", ret);
 					return 1;
 				}
 
-				ret = mosquitto_publish(mosq, NULL, TOPIC_STATE_CUR, strlen(acss.status), acss.status, 0, true);
+				ret = mqtt_publish_retained(&session, TOPIC_STATE_CUR, strlen(acss.status), acss.status, 0);
 				if (ret) {
 					fprintf(stderr, "Error could not send message: %d\n", ret);
 					return 1;
 				}
 
-				ret = mosquitto_publish(mosq, NULL, TOPIC_STATE_NEXT, strlen(acss.status_next), acss.status_next, 0, true);
+				ret = mqtt_publish_retained(&session, TOPIC_STATE_NEXT, strlen(acss.status_next), acss.status_next, 0);
 				if (ret) {
 					fprintf(stderr, "Error could not send message: %d\n", ret);
 					return 1;
 				}
 
-				ret = mosquitto_publish(mosq, NULL, TOPIC_MESSAGE, strlen(acss.message), acss.message, 0, true);
+				ret = mqtt_publish_retained(&session, TOPIC_MESSAGE, strlen(acss.message), acss.message, 0);
 				if (ret) {
 					fprintf(stderr, "Error could not send message: %d\n", ret);
 					return 1;
@@ -0,0 +1,449 @@
+/*
+ * Access Control System - Synthetic MQTT load generator
+ *
+ * Copyright (c) 2016, Sebastian Reichel <sre@mainframe.io>
+ *
+ * Permission to use, copy, modify, and/or distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY
+ * SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN ACTION
+ * OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF OR IN
+ * CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <time.h>
+#include <math.h>
+#include <errno.h>
+#include <mosquitto.h>
+#include "mqtt-log.h"
+#include "observer.h"
+
+#define DEFAULT_HOST "localhost"
+#define DEFAULT_PORT 1883
+#define DEFAULT_DURATION 60
+#define DEFAULT_SETTLE 5000
+
+/* how long a button is held down for a single (non bouncing) press */
+#define PRESS_TIME (100 * 1000ULL)
+
+#define MAX_GENERATORS 8
+
+#define TOPIC_MAIN_BUZZER "/access-control-system/main-door/buzzer"
+#define TOPIC_GLASS_BUZZER "/access-control-system/glass-door/buzzer"
+#define TOPIC_BELL "/access-control-system/bell"
+
+enum kind {
+	KIND_BUTTON,	/* "1" press, "0" release */
+	KIND_CONTACT,	/* toggles between "0" and "1" */
+	KIND_STATE,	/* toggles between "open" and "none" */
+};
+
+enum pattern {
+	PATTERN_POISSON,
+	PATTERN_BURST,
+	PATTERN_BOUNCE,
+};
+
+struct target {
+	const char *name;
+	const char *topic;
+	enum kind kind;
+	/* door daemon reacting to presses, NULL if none */
+	const char *daemon;
+};
+
+static const struct target targets[] = {
+	{ "main-bell", "/access-control-system/main-door/bell-button", KIND_BUTTON, "main-door" },
+	{ "glass-bell", "/access-control-system/glass-door/bell-button", KIND_BUTTON, "glass-door" },
+	{ "outside-bell", "/access-control-system/outside-door/bell-button", KIND_BUTTON, "outside-door" },
+	{ "main-reed", "/access-control-system/main-door/reed-switch", KIND_CONTACT, NULL },
+	{ "glass-reed", "/access-control-system/glass-door/reed-switch", KIND_CONTACT, NULL },
+	{ "bolt", "/access-control-system/main-door/bolt-state", KIND_CONTACT, NULL },
+	{ "space-state", "/access-control-system/space-state", KIND_STATE, NULL },
+	{}
+};
+
+/* outputs of each door daemon, the bell is shared */
+static const struct {
+	const char *daemon;
+	const char *outputs[3];
+} daemons[] = {
+	{ "main-door", { TOPIC_MAIN_BUZZER, TOPIC_BELL } },
+	{ "glass-door", { TOPIC_GLASS_BUZZER, TOPIC_BELL } },
+	{ "outside-door", { TOPIC_BELL } },
+	{}
+};
+
+struct generator {
+	const struct target *target;
+	enum pattern pattern;
+
+	/* poisson: events/s ; burst: count, gap, period ; bounce: edges, gap, period */
+	double rate;
+	int count;
+	uint64_t gap;
+	uint64_t period;
+
+	bool level;
+	bool pending_release;
+	int remaining;
+	uint64_t next;
+
+	unsigned long published;
+	unsigned long presses;
+};
+
+static struct observer observer;
+
+static void on_connect(struct mosquitto *m, void *data, int res) {
+	if (res) {
+		fprintf(stderr, "MQTT connection refused: %d\n", res);
+		exit(1);
+	}
+
+	if (observer_subscribe(&observer, m))
+		exit(1);
+}
+
+static void on_message(struct mosquitto *m, void *data, const struct mosquitto_message *msg) {
+	observer_message(&observer, msg);
+}
+
+static uint64_t exp_delay(double rate) {
+	return -log(1.0 - drand48()) / rate * 1000000.0;
+}
+
+/* target:poisson:<rate/s> | target:burst:<count>:<gap ms>:<period ms> | target:bounce:<edges>:<gap ms>:<period ms> */
+static int generator_parse(struct generator *g, char *spec) {
+	char *name = strtok(spec, ":");
+	char *pattern = strtok(NULL, ":");
+	char *arg[3];
+	int i;
+
+	memset(g, 0, sizeof(*g));
+
+	for (i = 0; i < 3; i++)
+		arg[i] = strtok(NULL, ":");
+
+	if (!name || !pattern)
+		return -EINVAL;
+
+	for (i = 0; targets[i].name; i++)
+		if (!strcmp(targets[i].name, name))
+			g->target = &targets[i];
+	if (!g->target) {
+		fprintf(stderr, "unknown target: %s\n", name);
+		return -EINVAL;
+	}
+
+	if (!strcmp(pattern, "poisson") && arg[0]) {
+		g->pattern = PATTERN_POISSON;
+		g->rate = atof(arg[0]);
+		if (g->rate <= 0)
+			return -EINVAL;
+	} else if ((!strcmp(pattern, "burst") || !strcmp(pattern, "bounce")) && arg[2]) {
+		g->pattern = strcmp(pattern, "burst") ? PATTERN_BOUNCE : PATTERN_BURST;
+		g->count = atoi(arg[0]);
+		g->gap = atoi(arg[1]) * 1000ULL;
+		g->period = atoi(arg[2]) * 1000ULL;
+		if (g->count <= 0)
+			return -EINVAL;
+	} else {
+		fprintf(stderr, "invalid pattern: %s\n", pattern);
+		return -EINVAL;
+	}
+
+	g->remaining = g->count;
+
+	return 0;
+}
+
+static void generator_publish(struct mosquitto *mosq, struct generator *g, bool level, uint64_t now) {
+	const char *payload;
+	int ret;
+
+	switch (g->target->kind) {
+		case KIND_STATE:
+			payload = level ? "open" : "none";
+			break;
+		default:
+			payload = level ? "1" : "0";
+			break;
+	}
+
+	/* a button release is no stimulus, nothing reacts to it */
+	if (g->target->kind != KIND_BUTTON || level) {
+		observer_stimulus(&observer, now);
+		if (g->target->kind == KIND_BUTTON)
+			g->presses++;
+	}
+
+	ret = mosquitto_publish(mosq, NULL, g->target->topic, strlen(payload), payload, 0, false);
+	if (ret)
+		fprintf(stderr, "Error could not publish %s: %d\n", g->target->topic, ret);
+	else
+		g->published++;
+
+	g->level = level;
+}
+
+/*
+ * Fire the event due at g->next and schedule the following one. Deadlines
+ * advance from the previous deadline, not from the wake-up time, so the
+ * wake-up latency does not accumulate.
+ */
+static void generator_step(struct mosquitto *mosq, struct generator *g, uint64_t now) {
+	/* buttons are released again after single presses */
+	if (g->pending_release) {
+		generator_publish(mosq, g, false, now);
+		g->pending_release = false;
+		if (g->pattern == PATTERN_BURST && !g->remaining) {
+			g->remaining = g->count;
+			g->next += g->period;
+		} else {
+			g->next += (g->pattern == PATTERN_POISSON ? exp_delay(g->rate) : g->gap);
+		}
+		return;
+	}
+
+	if (g->pattern == PATTERN_BOUNCE) {
+		/* contact chatter: count edges gap apart, then quiet for period */
+		generator_publish(mosq, g, !g->level, now);
+		if (--g->remaining) {
+			g->next += g->gap;
+		} else {
+			g->remaining = g->count;
+			g->next += g->period;
+		}
+		return;
+	}
+
+	if (g->target->kind == KIND_BUTTON) {
+		generator_publish(mosq, g, true, now);
+		g->pending_release = true;
+	} else {
+		generator_publish(mosq, g, !g->level, now);
+	}
+
+	if (g->pattern == PATTERN_BURST && !--g->remaining && !g->pending_release) {
+		g->remaining = g->count;
+		g->next += g->period;
+	} else if (g->pending_release) {
+		g->next += PRESS_TIME;
+	} else {
+		g->next += (g->pattern == PATTERN_POISSON ? exp_delay(g->rate) : g->gap);
+	}
+}
+
+static void sleep_until(uint64_t target) {
+	struct timespec ts = {
+		.tv_sec = target / 1000000,
+		.tv_nsec = (target % 1000000) * 1000,
+	};
+
+	while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &ts, NULL) == EINTR)
+		;
+}
+
+/* "1" or a "pulse:<ms>" command, the "0" is the release */
+static int activations(struct observer_topic *t) {
+	int i, count = 0;
+
+	for (i = 0; i < t->count; i++)
+		if (t->payloads[i][0] && t->payloads[i][0] != '0')
+			count++;
+
+	return count;
+}
+
+static void report(struct generator *gens, int count, double seconds) {
+	unsigned long presses, reactions;
+	char buf[256];
+	int i, j, idx;
+
+	printf("duration: %.1f s\n", seconds);
+
+	for (i = 0; i < count; i++)
+		printf("%s: published=%lu (%.2f/s)\n", gens[i].target->name, gens[i].published, gens[i].published / seconds);
+
+	for (i = 0; i < observer.topic_count; i++) {
+		struct observer_topic *t = &observer.topics[i];
+
+		printf("%s: messages=%d activations=%d\n", t->topic, t->count, activations(t));
+		t->latency.name = "  reaction latency (us)";
+		histogram_format(&t->latency, buf, sizeof(buf));
+		printf("%s", buf);
+	}
+
+	/* presses the daemon did not react to, exact when one door is loaded */
+	for (i = 0; daemons[i].daemon; i++) {
+		presses = reactions = 0;
+
+		for (j = 0; j < count; j++)
+			if (gens[j].target->daemon && !strcmp(gens[j].target->daemon, daemons[i].daemon))
+				presses += gens[j].presses;
+		if (!presses)
+			continue;
+
+		for (j = 0; daemons[i].outputs[j]; j++) {
+			idx = observer_find(&observer, daemons[i].outputs[j]);
+			if (idx >= 0)
+				reactions += activations(&observer.topics[idx]);
+		}
+
+		printf("%s: presses=%lu reactions=%lu dropped=%lu\n", daemons[i].daemon, presses, reactions,
+			presses > reactions ? presses - reactions : 0);
+	}
+}
+
+static void usage(const char *name) {
+	int i;
+
+	fprintf(stderr, "%s [-h host] [-p port] [-d seconds] [-w ms] [-S seed] <generator>...\n", name);
+	fprintf(stderr, "\thost/port: broker with the daemons under test, default %s:%d\n", DEFAULT_HOST, DEFAULT_PORT);
+	fprintf(stderr, "\tseconds:   load duration, default %d\n", DEFAULT_DURATION);
+	fprintf(stderr, "\tms:        time to wait for outputs afterwards, default %d\n", DEFAULT_SETTLE);
+	fprintf(stderr, "\tgenerator: <target>:poisson:<events/s>\n");
+	fprintf(stderr, "\t           <target>:burst:<count>:<gap ms>:<period ms>\n");
+	fprintf(stderr, "\t           <target>:bounce:<edges>:<gap ms>:<period ms>\n");
+	fprintf(stderr, "\ttarget:    ");
+	for (i = 0; targets[i].name; i++)
+		fprintf(stderr, "%s ", targets[i].name);
+	fprintf(stderr, "\n");
+}
+
+int main(int argc, char **argv) {
+	struct generator gens[MAX_GENERATORS];
+	struct mosquitto *mosq;
+	const char *host = DEFAULT_HOST;
+	int port = DEFAULT_PORT;
+	int duration = DEFAULT_DURATION;
+	int settle = DEFAULT_SETTLE;
+	long seed = time(NULL);
+	uint64_t start, end, now;
+	int i, opt, ret, count = 0;
+	struct generator *g;
+
+	while ((opt = getopt(argc, argv, "h:p:d:w:S:")) != -1) {
+		switch (opt) {
+			case 'h':
+				host = optarg;
+				break;
+			case 'p':
+				port = atoi(optarg);
+				break;
+			case 'd':
+				duration = atoi(optarg);
+				break;
+			case 'w':
+				settle = atoi(optarg);
+				break;
+			case 'S':
+				seed = atol(optarg);
+				break;
+			default:
+				usage(argv[0]);
+				return 1;
+		}
+	}
+
+	if (argc - optind > MAX_GENERATORS) {
+		fprintf(stderr, "at most %d generators\n", MAX_GENERATORS);
+		usage(argv[0]);
+		return 1;
+	}
+
+	for (i = optind; i < argc; i++) {
+		if (generator_parse(&gens[count], argv[i])) {
+			usage(argv[0]);
+			return 1;
+		}
+		count++;
+	}
+
+	if (!count) {
+		usage(argv[0]);
+		return 1;
+	}
+
+	srand48(seed);
+
+	observer_init(&observer);
+	observer_add(&observer, TOPIC_MAIN_BUZZER);
+	observer_add(&observer, TOPIC_GLASS_BUZZER);
+	observer_add(&observer, TOPIC_BELL);
+
+	mosquitto_lib_init();
+
+	mosq = mosquitto_new(NULL, true, NULL);
+	if (!mosq) {
+		fprintf(stderr, "Error: Out of memory.\n");
+		return 1;
+	}
+
+	mosquitto_connect_callback_set(mosq, on_connect);
+	mosquitto_message_callback_set(mosq, on_message);
+
+	ret = mosquitto_connect(mosq, host, port, 60);
+	if (ret) {
+		fprintf(stderr, "Error could not connect to broker: %d\n", ret);
+		return 1;
+	}
+
+	ret = mosquitto_loop_start(mosq);
+	if (ret) {
+		fprintf(stderr, "Error could not start mosquitto network loop: %d\n", ret);
+		return 1;
+	}
+
+	/* let the subscriptions settle before the first stimulus */
+	sleep(1);
+
+	start = mqtt_log_now();
+	end = start + duration * 1000000ULL;
+	for (i = 0; i < count; i++)
+		gens[i].next = start;
+
+	fprintf(stderr, "Generating load for %d s (seed %ld)\n", duration, seed);
+
+	for (;;) {
+		g = &gens[0];
+		for (i = 1; i < count; i++)
+			if (gens[i].next < g->next)
+				g = &gens[i];
+
+		if (g->next >= end)
+			break;
+
+		sleep_until(g->next);
+		now = mqtt_log_now();
+		generator_step(mosq, g, now);
+	}
+
+	/* do not leave buttons pressed */
+	for (i = 0; i < count; i++)
+		if (gens[i].target->kind == KIND_BUTTON && gens[i].level)
+			generator_publish(mosq, &gens[i], false, mqtt_log_now());
+
+	usleep(settle * 1000);
+
+	mosquitto_disconnect(mosq);
+	mosquitto_loop_stop(mosq, false);
+
+	pthread_mutex_lock(&observer.lock);
+	report(gens, count, duration);
+	pthread_mutex_unlock(&observer.lock);
+
+	mosquitto_destroy(mosq);
+	mosquitto_lib_cleanup();
+	return 0;
+}
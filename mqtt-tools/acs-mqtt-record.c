@@ -0,0 +1,202 @@
+/*
+ * Access Control System - MQTT traffic recorder
+ *
+ * Copyright (c) 2016, Sebastian Reichel <sre@mainframe.io>
+ *
+ * Permission to use, copy, modify, and/or distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY
+ * SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN ACTION
+ * OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF OR IN
+ * CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <signal.h>
+#include <pthread.h>
+#include <mosquitto.h>
+#include "../common/config.h"
+#include "mqtt-log.h"
+
+#define TOPIC_ALL "/access-control-system/#"
+
+struct recorder {
+	FILE *log;
+	uint64_t start;
+	unsigned long count;
+	char **topics;
+	int topic_count;
+	pthread_mutex_t lock;
+};
+
+static volatile sig_atomic_t stop = 0;
+
+static void on_signal(int signal) {
+	stop = 1;
+}
+
+static void on_connect(struct mosquitto *m, void *data, int res) {
+	struct recorder *rec = data;
+	int i, ret;
+
+	if (res) {
+		fprintf(stderr, "MQTT connection refused: %d\n", res);
+		return;
+	}
+
+	fprintf(stderr, "MQTT connected, recording...\n");
+
+	for (i = 0; i < rec->topic_count; i++) {
+		ret = mosquitto_subscribe(m, NULL, rec->topics[i], 1);
+		if (ret) {
+			fprintf(stderr, "Error could not subscribe to %s: %d\n", rec->topics[i], ret);
+			exit(1);
+		}
+	}
+}
+
+static void on_message(struct mosquitto *m, void *data, const struct mosquitto_message *msg) {
+	struct recorder *rec = data;
+	struct mqtt_log_entry e = {
+		.stamp = mqtt_log_now() - rec->start,
+		.retain = msg->retain,
+		.topic = msg->topic,
+		.payload = msg->payload,
+		.payloadlen = msg->payloadlen,
+	};
+
+	pthread_mutex_lock(&rec->lock);
+	if (mqtt_log_write(rec->log, &e))
+		fprintf(stderr, "Error could not write log record\n");
+	else
+		rec->count++;
+	pthread_mutex_unlock(&rec->lock);
+}
+
+static void usage(const char *name) {
+	fprintf(stderr, "%s [-h host] [-p port] <logfile> [topic...]\n", name);
+	fprintf(stderr, "\thost/port: default from %s\n", CONFIGFILE);
+	fprintf(stderr, "\ttopic:     subscription filter, default %s\n", TOPIC_ALL);
+}
+
+int main(int argc, char **argv) {
+	static char *default_topics[] = { TOPIC_ALL };
+	struct recorder rec = { .lock = PTHREAD_MUTEX_INITIALIZER };
+	struct mosquitto *mosq;
+	char *host_arg = NULL;
+	int port_arg = 0;
+	int opt, ret;
+
+	while ((opt = getopt(argc, argv, "h:p:")) != -1) {
+		switch (opt) {
+			case 'h':
+				host_arg = optarg;
+				break;
+			case 'p':
+				port_arg = atoi(optarg);
+				break;
+			default:
+				usage(argv[0]);
+				return 1;
+		}
+	}
+
+	if (optind >= argc) {
+		usage(argv[0]);
+		return 1;
+	}
+
+	rec.log = mqtt_log_create(argv[optind]);
+	if (!rec.log) {
+		fprintf(stderr, "Could not create %s\n", argv[optind]);
+		return 1;
+	}
+
+	if (optind + 1 < argc) {
+		rec.topics = argv + optind + 1;
+		rec.topic_count = argc - optind - 1;
+	} else {
+		rec.topics = default_topics;
+		rec.topic_count = 1;
+	}
+
+	mosquitto_lib_init();
+
+	FILE *cfg = cfg_open();
+	char *user = cfg_get_default(cfg, "mqtt-username", MQTT_USERNAME);
+	char *pass = cfg_get_default(cfg, "mqtt-password", MQTT_PASSWORD);
+	char *cert = cfg_get_default(cfg, "mqtt-broker-cert", MQTT_BROKER_CERT);
+	char *host = cfg_get_default(cfg, "mqtt-broker-host", MQTT_BROKER_HOST);
+	int port = cfg_get_int_default(cfg, "mqtt-broker-port", MQTT_BROKER_PORT);
+	int keepalv = cfg_get_int_default(cfg, "mqtt-keepalive", MQTT_KEEPALIVE_SECONDS);
+	cfg_close(cfg);
+
+	mosq = mosquitto_new(NULL, true, &rec);
+	if (!mosq) {
+		fprintf(stderr, "Error: Out of memory.\n");
+		return 1;
+	}
+
+	mosquitto_connect_callback_set(mosq, on_connect);
+	mosquitto_message_callback_set(mosq, on_message);
+
+	if (strcmp(user, "")) {
+		ret = mosquitto_username_pw_set(mosq, user, pass);
+		if (ret) {
+			fprintf(stderr, "Error setting credentials: %d\n", ret);
+			return 1;
+		}
+	}
+
+	/* an explicit broker is usually a local test instance without TLS */
+	if (strcmp(cert, "") && !host_arg) {
+		ret = mosquitto_tls_set(mosq, cert, NULL, NULL, NULL, NULL);
+		if (ret) {
+			fprintf(stderr, "Error setting TLS mode: %d\n", ret);
+			return 1;
+		}
+	}
+
+	rec.start = mqtt_log_now();
+
+	ret = mosquitto_connect(mosq, host_arg ? host_arg : host, port_arg ? port_arg : port, keepalv);
+	if (ret) {
+		fprintf(stderr, "Error could not connect to broker: %d\n", ret);
+		return 1;
+	}
+
+	signal(SIGINT, on_signal);
+	signal(SIGTERM, on_signal);
+
+	ret = mosquitto_loop_start(mosq);
+	if (ret) {
+		fprintf(stderr, "Error could not start mosquitto network loop: %d\n", ret);
+		return 1;
+	}
+
+	while (!stop)
+		sleep(1);
+
+	mosquitto_disconnect(mosq);
+	mosquitto_loop_stop(mosq, false);
+
+	fclose(rec.log);
+	fprintf(stderr, "Recorded %lu messages in %.1f s\n", rec.count, (mqtt_log_now() - rec.start) / 1e6);
+
+	free(user);
+	free(pass);
+	free(cert);
+	free(host);
+
+	mosquitto_destroy(mosq);
+	mosquitto_lib_cleanup();
+	return 0;
+}
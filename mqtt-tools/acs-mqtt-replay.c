@@ -0,0 +1,290 @@
+/*
+ * Access Control System - MQTT traffic replay
+ *
+ * Copyright (c) 2016, Sebastian Reichel <sre@mainframe.io>
+ *
+ * Permission to use, copy, modify, and/or distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY
+ * SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN ACTION
+ * OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF OR IN
+ * CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <time.h>
+#include <errno.h>
+#include <mosquitto.h>
+#include "../common/trace.h"
+#include "../common/edge.h"
+#include "mqtt-log.h"
+#include "observer.h"
+
+#define DEFAULT_HOST "localhost"
+#define DEFAULT_PORT 1883
+#define DEFAULT_SETTLE 5000
+
+/* the daemons' outputs, everything else in a recording is an input */
+static const char *default_outputs[] = {
+	"/access-control-system/main-door/buzzer",
+	"/access-control-system/glass-door/buzzer",
+	"/access-control-system/bell",
+	NULL
+};
+
+struct recording {
+	struct mqtt_log_entry *entries;
+	int count;
+	int size;
+};
+
+static struct observer replayed;
+
+static void on_connect(struct mosquitto *m, void *data, int res) {
+	if (res) {
+		fprintf(stderr, "MQTT connection refused: %d\n", res);
+		exit(1);
+	}
+
+	if (observer_subscribe(&replayed, m))
+		exit(1);
+}
+
+static void on_message(struct mosquitto *m, void *data, const struct mosquitto_message *msg) {
+	observer_message(&replayed, msg);
+}
+
+static bool has_suffix(const char *topic, const char *suffix) {
+	size_t len = strlen(topic);
+	size_t slen = strlen(suffix);
+
+	return len > slen && !strcmp(topic + len - slen, suffix);
+}
+
+/* traces and edge records describe another message, they are no inputs */
+static bool is_trace(const char *topic) {
+	return has_suffix(topic, TRACE_SUFFIX) || has_suffix(topic, EDGE_SUFFIX);
+}
+
+static int recording_load(const char *path, struct recording *rec) {
+	struct mqtt_log_entry e;
+	FILE *f;
+	int ret;
+
+	f = mqtt_log_open(path);
+	if (!f)
+		return -1;
+
+	while ((ret = mqtt_log_read(f, &e)) > 0) {
+		if (rec->count == rec->size) {
+			int size = rec->size ? 2 * rec->size : 1024;
+			struct mqtt_log_entry *entries = realloc(rec->entries, size * sizeof(*entries));
+			if (!entries) {
+				ret = -1;
+				break;
+			}
+			rec->entries = entries;
+			rec->size = size;
+		}
+		rec->entries[rec->count++] = e;
+	}
+
+	fclose(f);
+	return ret;
+}
+
+/* recorded outputs and their latency relative to the preceding input */
+static void recording_analyze(struct recording *rec, struct observer *recorded) {
+	uint64_t last_input = 0;
+	bool have_input = false;
+	int i, idx;
+
+	for (i = 0; i < rec->count; i++) {
+		struct mqtt_log_entry *e = &rec->entries[i];
+
+		if (e->retain || is_trace(e->topic))
+			continue;
+
+		idx = observer_find(recorded, e->topic);
+		if (idx < 0) {
+			last_input = e->stamp;
+			have_input = true;
+		} else if (have_input) {
+			observer_append(recorded, idx, e->payload, e->payloadlen, e->stamp - last_input);
+		}
+	}
+}
+
+static void sleep_until(uint64_t target) {
+	struct timespec ts = {
+		.tv_sec = target / 1000000,
+		.tv_nsec = (target % 1000000) * 1000,
+	};
+
+	while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &ts, NULL) == EINTR)
+		;
+}
+
+static void report(struct observer *recorded, struct observer *replayed) {
+	char buf[256];
+	int i;
+
+	for (i = 0; i < recorded->topic_count; i++) {
+		struct observer_topic *a = &recorded->topics[i];
+		struct observer_topic *b = &replayed->topics[i];
+
+		printf("%s: recorded=%d replayed=%d matching=%d\n", a->topic, a->count, b->count, observer_compare(a, b));
+
+		a->latency.name = "  recorded latency (us)";
+		histogram_format(&a->latency, buf, sizeof(buf));
+		printf("%s", buf);
+
+		b->latency.name = "  replayed latency (us)";
+		histogram_format(&b->latency, buf, sizeof(buf));
+		printf("%s", buf);
+	}
+}
+
+static void usage(const char *name) {
+	fprintf(stderr, "%s [-h host] [-p port] [-s speed | -f] [-w ms] [-o topic]... <logfile>\n", name);
+	fprintf(stderr, "\thost/port: broker with the daemons under test, default %s:%d\n", DEFAULT_HOST, DEFAULT_PORT);
+	fprintf(stderr, "\tspeed:     replay speed factor, default 1 (real time)\n");
+	fprintf(stderr, "\t-f:        replay as fast as possible\n");
+	fprintf(stderr, "\tms:        time to wait for outputs after the last input, default %d\n", DEFAULT_SETTLE);
+	fprintf(stderr, "\ttopic:     output topic to compare, default buzzers and bell\n");
+}
+
+int main(int argc, char **argv) {
+	struct recording rec = {};
+	struct observer recorded;
+	struct mosquitto *mosq;
+	const char *host = DEFAULT_HOST;
+	int port = DEFAULT_PORT;
+	double speed = 1.0;
+	bool fast = false;
+	int settle = DEFAULT_SETTLE;
+	uint64_t start;
+	int i, opt, ret, sent = 0;
+
+	observer_init(&recorded);
+	observer_init(&replayed);
+
+	while ((opt = getopt(argc, argv, "h:p:s:fw:o:")) != -1) {
+		switch (opt) {
+			case 'h':
+				host = optarg;
+				break;
+			case 'p':
+				port = atoi(optarg);
+				break;
+			case 's':
+				speed = atof(optarg);
+				break;
+			case 'f':
+				fast = true;
+				break;
+			case 'w':
+				settle = atoi(optarg);
+				break;
+			case 'o':
+				observer_add(&recorded, optarg);
+				observer_add(&replayed, optarg);
+				break;
+			default:
+				usage(argv[0]);
+				return 1;
+		}
+	}
+
+	if (optind >= argc || speed <= 0) {
+		usage(argv[0]);
+		return 1;
+	}
+
+	if (!recorded.topic_count) {
+		for (i = 0; default_outputs[i]; i++) {
+			observer_add(&recorded, default_outputs[i]);
+			observer_add(&replayed, default_outputs[i]);
+		}
+	}
+
+	if (recording_load(argv[optind], &rec)) {
+		fprintf(stderr, "Could not read %s\n", argv[optind]);
+		return 1;
+	}
+
+	recording_analyze(&rec, &recorded);
+
+	mosquitto_lib_init();
+
+	mosq = mosquitto_new(NULL, true, NULL);
+	if (!mosq) {
+		fprintf(stderr, "Error: Out of memory.\n");
+		return 1;
+	}
+
+	mosquitto_connect_callback_set(mosq, on_connect);
+	mosquitto_message_callback_set(mosq, on_message);
+
+	ret = mosquitto_connect(mosq, host, port, 60);
+	if (ret) {
+		fprintf(stderr, "Error could not connect to broker: %d\n", ret);
+		return 1;
+	}
+
+	ret = mosquitto_loop_start(mosq);
+	if (ret) {
+		fprintf(stderr, "Error could not start mosquitto network loop: %d\n", ret);
+		return 1;
+	}
+
+	/* let the subscriptions settle before the first stimulus */
+	sleep(1);
+
+	start = mqtt_log_now();
+
+	for (i = 0; i < rec.count; i++) {
+		struct mqtt_log_entry *e = &rec.entries[i];
+
+		/* outputs are produced by the daemons, stale traces and edge records are useless */
+		if (observer_find(&recorded, e->topic) >= 0 || is_trace(e->topic))
+			continue;
+
+		if (!fast && !e->retain)
+			sleep_until(start + e->stamp / speed);
+
+		observer_stimulus(&replayed, mqtt_log_now());
+		ret = mosquitto_publish(mosq, NULL, e->topic, e->payloadlen, e->payload, 0, e->retain);
+		if (ret) {
+			fprintf(stderr, "Error could not publish %s: %d\n", e->topic, ret);
+			return 1;
+		}
+		sent++;
+	}
+
+	fprintf(stderr, "Replayed %d inputs in %.1f s, waiting %d ms for outputs\n", sent, (mqtt_log_now() - start) / 1e6, settle);
+	usleep(settle * 1000);
+
+	mosquitto_disconnect(mosq);
+	mosquitto_loop_stop(mosq, false);
+
+	pthread_mutex_lock(&replayed.lock);
+	report(&recorded, &replayed);
+	pthread_mutex_unlock(&replayed.lock);
+
+	for (i = 0; i < rec.count; i++)
+		mqtt_log_entry_free(&rec.entries[i]);
+	free(rec.entries);
+
+	mosquitto_destroy(mosq);
+	mosquitto_lib_cleanup();
+	return 0;
+}
@@ -0,0 +1,135 @@
+/*
+ * Access Control System - MQTT traffic log
+ *
+ * Copyright (c) 2016, Sebastian Reichel <sre@mainframe.io>
+ *
+ * Permission to use, copy, modify, and/or distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY
+ * SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN ACTION
+ * OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF OR IN
+ * CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "mqtt-log.h"
+
+#define MQTT_LOG_RECORD_HEADER 15
+
+uint64_t mqtt_log_now() {
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t) ts.tv_sec * 1000000ULL + ts.tv_nsec / 1000;
+}
+
+FILE *mqtt_log_create(const char *path) {
+	FILE *f = fopen(path, "wb");
+	uint8_t version = MQTT_LOG_VERSION;
+
+	if (!f)
+		return NULL;
+
+	if (fwrite(MQTT_LOG_MAGIC, 8, 1, f) != 1 || fwrite(&version, 1, 1, f) != 1) {
+		fclose(f);
+		return NULL;
+	}
+
+	return f;
+}
+
+FILE *mqtt_log_open(const char *path) {
+	FILE *f = fopen(path, "rb");
+	char magic[8];
+	uint8_t version;
+
+	if (!f)
+		return NULL;
+
+	if (fread(magic, 8, 1, f) != 1 || fread(&version, 1, 1, f) != 1 ||
+	    memcmp(magic, MQTT_LOG_MAGIC, 8) || version != MQTT_LOG_VERSION) {
+		fprintf(stderr, "%s: not a version %d mqtt log\n", path, MQTT_LOG_VERSION);
+		fclose(f);
+		return NULL;
+	}
+
+	return f;
+}
+
+int mqtt_log_write(FILE *f, const struct mqtt_log_entry *e) {
+	uint8_t hdr[MQTT_LOG_RECORD_HEADER];
+	size_t topiclen = strlen(e->topic);
+	int i;
+
+	for (i = 0; i < 8; i++)
+		hdr[i] = e->stamp >> (56 - 8*i);
+	hdr[8] = e->retain ? MQTT_LOG_FLAG_RETAIN : 0;
+	hdr[9] = topiclen >> 8;
+	hdr[10] = topiclen & 0xff;
+	for (i = 0; i < 4; i++)
+		hdr[11 + i] = (uint32_t) e->payloadlen >> (24 - 8*i);
+
+	if (fwrite(hdr, sizeof(hdr), 1, f) != 1)
+		return -1;
+	if (fwrite(e->topic, topiclen, 1, f) != 1)
+		return -1;
+	if (e->payloadlen && fwrite(e->payload, e->payloadlen, 1, f) != 1)
+		return -1;
+
+	return 0;
+}
+
+/* returns 1 for a record, 0 at the end of the log and -1 on errors */
+int mqtt_log_read(FILE *f, struct mqtt_log_entry *e) {
+	uint8_t hdr[MQTT_LOG_RECORD_HEADER];
+	size_t topiclen;
+	uint32_t payloadlen = 0;
+	int i;
+
+	memset(e, 0, sizeof(*e));
+
+	if (fread(hdr, sizeof(hdr), 1, f) != 1)
+		return feof(f) ? 0 : -1;
+
+	for (i = 0; i < 8; i++)
+		e->stamp = (e->stamp << 8) | hdr[i];
+	e->retain = hdr[8] & MQTT_LOG_FLAG_RETAIN;
+	topiclen = (hdr[9] << 8) | hdr[10];
+	for (i = 0; i < 4; i++)
+		payloadlen = (payloadlen << 8) | hdr[11 + i];
+
+	e->topic = malloc(topiclen + 1);
+	e->payload = malloc(payloadlen + 1);
+	if (!e->topic || !e->payload)
+		goto fail;
+
+	if (fread(e->topic, topiclen, 1, f) != 1)
+		goto fail;
+	if (payloadlen && fread(e->payload, payloadlen, 1, f) != 1)
+		goto fail;
+
+	e->topic[topiclen] = '\0';
+	((char *) e->payload)[payloadlen] = '\0';
+	e->payloadlen = payloadlen;
+
+	return 1;
+
+fail:
+	mqtt_log_entry_free(e);
+	return -1;
+}
+
+void mqtt_log_entry_free(struct mqtt_log_entry *e) {
+	free(e->topic);
+	free(e->payload);
+	e->topic = NULL;
+	e->payload = NULL;
+}
@@ -0,0 +1,38 @@
+#ifndef __MQTT_LOG_H
+#define __MQTT_LOG_H
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stdbool.h>
+
+/*
+ * Binary MQTT traffic log, written by acs-mqtt-record:
+ *
+ * header: "ACSMQLOG" [version]
+ * record: [stamp us:64] [flags] [topic len:16] [payload len:32] [topic] [payload]
+ *
+ * All numbers are big endian, stamps are relative to the start of the
+ * recording. The retain flag marks retained values delivered on subscribe,
+ * i.e. the state of the system when the recording was started.
+ */
+#define MQTT_LOG_MAGIC "ACSMQLOG"
+#define MQTT_LOG_VERSION 1
+#define MQTT_LOG_FLAG_RETAIN 0x01
+
+struct mqtt_log_entry {
+	uint64_t stamp;
+	bool retain;
+	char *topic;
+	void *payload;
+	int payloadlen;
+};
+
+FILE *mqtt_log_create(const char *path);
+FILE *mqtt_log_open(const char *path);
+int mqtt_log_write(FILE *f, const struct mqtt_log_entry *e);
+int mqtt_log_read(FILE *f, struct mqtt_log_entry *e);
+void mqtt_log_entry_free(struct mqtt_log_entry *e);
+
+uint64_t mqtt_log_now();
+
+#endif
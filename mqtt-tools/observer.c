@@ -0,0 +1,121 @@
+/*
+ * Access Control System - MQTT output observer
+ *
+ * Copyright (c) 2016, Sebastian Reichel <sre@mainframe.io>
+ *
+ * Permission to use, copy, modify, and/or distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY
+ * SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN ACTION
+ * OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF OR IN
+ * CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "observer.h"
+#include "mqtt-log.h"
+
+void observer_init(struct observer *o) {
+	memset(o, 0, sizeof(*o));
+	pthread_mutex_init(&o->lock, NULL);
+}
+
+int observer_add(struct observer *o, const char *topic) {
+	struct observer_topic *t;
+
+	if (o->topic_count == OBSERVER_MAX_TOPICS)
+		return -1;
+
+	t = &o->topics[o->topic_count];
+	t->topic = topic;
+	histogram_init(&t->latency, "latency");
+
+	return o->topic_count++;
+}
+
+int observer_find(struct observer *o, const char *topic) {
+	int i;
+
+	for (i = 0; i < o->topic_count; i++)
+		if (!strcmp(o->topics[i].topic, topic))
+			return i;
+
+	return -1;
+}
+
+int observer_subscribe(struct observer *o, struct mosquitto *mosq) {
+	int i, ret;
+
+	for (i = 0; i < o->topic_count; i++) {
+		ret = mosquitto_subscribe(mosq, NULL, o->topics[i].topic, 1);
+		if (ret) {
+			fprintf(stderr, "Error could not subscribe to %s: %d\n", o->topics[i].topic, ret);
+			return ret;
+		}
+	}
+
+	return 0;
+}
+
+void observer_stimulus(struct observer *o, uint64_t now) {
+	pthread_mutex_lock(&o->lock);
+	o->last_stimulus = now;
+	pthread_mutex_unlock(&o->lock);
+}
+
+/* latency in us, payloads are kept for the output stream comparison */
+void observer_append(struct observer *o, int idx, const void *payload, int payloadlen, uint64_t latency) {
+	struct observer_topic *t = &o->topics[idx];
+
+	if (t->count == t->size) {
+		int size = t->size ? 2 * t->size : 64;
+		char **payloads = realloc(t->payloads, size * sizeof(*payloads));
+		if (!payloads)
+			return;
+		t->payloads = payloads;
+		t->size = size;
+	}
+
+	t->payloads[t->count] = strndup(payload, payloadlen);
+	if (!t->payloads[t->count])
+		return;
+	t->count++;
+
+	histogram_record(&t->latency, latency);
+}
+
+void observer_message(struct observer *o, const struct mosquitto_message *msg) {
+	uint64_t now = mqtt_log_now();
+	int idx;
+
+	/* stale values from before the run, not a reaction */
+	if (msg->retain)
+		return;
+
+	pthread_mutex_lock(&o->lock);
+	idx = observer_find(o, msg->topic);
+	if (idx >= 0 && o->last_stimulus)
+		observer_append(o, idx, msg->payload, msg->payloadlen, now - o->last_stimulus);
+	pthread_mutex_unlock(&o->lock);
+}
+
+/* number of positions where both output streams carry the same payload */
+int observer_compare(struct observer_topic *a, struct observer_topic *b) {
+	int i, matching = 0;
+
+	for (i = 0; i < a->count && i < b->count; i++)
+		if (!strcmp(a->payloads[i], b->payloads[i]))
+			matching++;
+
+	return matching;
+}
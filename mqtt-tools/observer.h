@@ -0,0 +1,41 @@
+#ifndef __OBSERVER_H
+#define __OBSERVER_H
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <pthread.h>
+#include <mosquitto.h>
+#include "../common/histogram.h"
+
+/*
+ * Collects the output stream of the daemons under test. The latency of an
+ * output is measured from the most recent stimulus (input message) sent
+ * before it, which is what a daemon reacts to.
+ */
+#define OBSERVER_MAX_TOPICS 16
+
+struct observer_topic {
+	const char *topic;
+	struct histogram latency;
+	char **payloads;
+	int count;
+	int size;
+};
+
+struct observer {
+	pthread_mutex_t lock;
+	struct observer_topic topics[OBSERVER_MAX_TOPICS];
+	int topic_count;
+	uint64_t last_stimulus;
+};
+
+void observer_init(struct observer *o);
+int observer_add(struct observer *o, const char *topic);
+int observer_find(struct observer *o, const char *topic);
+int observer_subscribe(struct observer *o, struct mosquitto *mosq);
+void observer_stimulus(struct observer *o, uint64_t now);
+void observer_append(struct observer *o, int idx, const void *payload, int payloadlen, uint64_t latency);
+void observer_message(struct observer *o, const struct mosquitto_message *msg);
+int observer_compare(struct observer_topic *a, struct observer_topic *b);
+
+#endif
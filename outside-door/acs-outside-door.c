@@ -24,8 +24,13 @@
 #include <stdlib.h>
 #include <signal.h>
 #include "../common/config.h"
+#include "../common/mqtt.h"
+#include "../common/localbus.h"
 
 #define TOPIC_BELL "/access-control-system/bell"
+
+/* acs-gpio-actor switches the bell off again on its own */
+#define PULSE_BELL "pulse:2000"
 #define TOPIC_BELL_BUTTON "/access-control-system/outside-door/bell-button"
 
 struct userdata {
@@ -38,10 +43,14 @@ struct userdata {
 
 struct userdata *globaludata;
 
+static struct mqtt_session session;
+static struct localbus local;
+
 static void on_connect(struct mosquitto *m, void *udata, int res) {
 	int ret;
 
 	fprintf(stderr, "Connected.\n");
+	mqtt_session_connected(&session, res);
 
 	ret = mosquitto_subscribe(m, NULL, TOPIC_BELL_BUTTON, 1);
 	if (ret) {
@@ -52,7 +61,7 @@ static void on_connect(struct mosquitto *m, void *udata, int res) {
 
 static void on_disconnect(struct mosquitto *m, void *data, int res) {
 	fprintf(stderr, "MQTT Disconnected.\n");
-	exit(1);
+	mqtt_session_disconnected(&session, res);
 }
 
 static void on_subscribe(struct mosquitto *m, void *udata, int mid, int qos_count, const int *granted_qos) {
@@ -87,7 +96,7 @@ static void on_button_message(struct mosquitto *m, void *data, const struct mosq
 
 	udata->eventinprogress = true;
 
-	mosquitto_publish(m, NULL, TOPIC_BELL, 2, "1", 0, true);
+	mqtt_publish_volatile(&session, TOPIC_BELL, sizeof(PULSE_BELL), PULSE_BELL, 0);
 	alarm(2);
 }
 
@@ -102,12 +111,16 @@ static void on_message(struct mosquitto *m, void *data, const struct mosquitto_m
 	return;
 }
 
+/* the pulse is over, accept the next button press */
 void on_alarm(int signal) {
 	printf("alarm!\n");
-	mosquitto_publish(globaludata->mosq, NULL, TOPIC_BELL, 2, "0", 0, true);
 	globaludata->eventinprogress = false;
 }
 
+static void on_broker_message(struct mosquitto *m, void *data, const struct mosquitto_message *msg) {
+	localbus_dispatch(&local, msg);
+}
+
 int main(int argc, char **argv) {
 	struct mosquitto *mosq;
 	struct userdata udata;
@@ -123,6 +136,9 @@ int main(int argc, char **argv) {
 	char *host = cfg_get_default(cfg, "mqtt-broker-host", MQTT_BROKER_HOST);
 	int port = cfg_get_int_default(cfg, "mqtt-broker-port", MQTT_BROKER_PORT);
 	int keepalv = cfg_get_int_default(cfg, "mqtt-keepalive", MQTT_KEEPALIVE_SECONDS);
+	int delay_min = cfg_get_int_default(cfg, "mqtt-reconnect-delay-min", MQTT_RECONNECT_DELAY_MIN);
+	int delay_max = cfg_get_int_default(cfg, "mqtt-reconnect-delay-max", MQTT_RECONNECT_DELAY_MAX);
+	char *localdir = cfg_get_default(cfg, "localbus-dir", LOCALBUS_DIR);
 	cfg_close(cfg);
 
 	/* create mosquitto client instance */
@@ -139,7 +155,7 @@ int main(int argc, char **argv) {
 	mosquitto_disconnect_callback_set(mosq, on_disconnect);
 	mosquitto_subscribe_callback_set(mosq, on_subscribe);
 	mosquitto_log_callback_set(mosq, on_log);
-	mosquitto_message_callback_set(mosq, on_message);
+	mosquitto_message_callback_set(mosq, on_broker_message);
 
 	/* setup credentials */
 	if (strcmp(user, "")) {
@@ -165,7 +181,8 @@ int main(int argc, char **argv) {
 	}
 
 	/* connect to broker */
-	ret = mosquitto_connect(mosq, host, port, keepalv);
+	mqtt_session_init(&session, mosq, delay_min, delay_max);
+	ret = mqtt_session_connect(&session, host, port, keepalv);
 	if (ret) {
 		fprintf(stderr, "Error could not connect to broker: %d\n", ret);
 		return 1;
@@ -177,7 +194,19 @@ int main(int argc, char **argv) {
 	globaludata = &udata;
 	signal(SIGALRM, on_alarm);
 
-	ret = mosquitto_loop_forever(mosq, -1, 1);
+	/* on-device topics bypass the broker */
+	localbus_init(&local, mosq, &udata, on_message);
+	ret = localbus_open(&local, localdir, "outside-door");
+	if (!ret) {
+		ret |= localbus_subscribe(&local, TOPIC_BELL_BUTTON);
+		ret |= localbus_start(&local);
+	}
+	if (ret)
+		fprintf(stderr, "Local bus disabled: %d\n", ret);
+	else
+		mqtt_session_set_localbus(&session, &local);
+
+	ret = mqtt_session_loop_forever(&session);
 	if (ret) {
 		fprintf(stderr, "Error could not setup mosquitto network loop: %d\n", ret);
 		return 1;
@@ -19,6 +19,7 @@
 #include <linux/sockios.h>
 #include <mosquitto.h>
 #include "../common/config.h"
+#include "../common/snapshot.h"
 
 #define STATE_TOPIC "/access-control-system/space-state"
 const static char* states[] = {
@@ -46,6 +47,10 @@ enum states2 {
 struct userdata {
 	struct mosquitto *mosq;
 	enum states2 state;
+
+	/* last aggregated state, preferred over STATE_TOPIC once seen */
+	struct snapshot snapshot;
+	bool snapshot_seen;
 };
 
 #define display_size 32+1
@@ -157,6 +162,12 @@ static void on_connect(struct mosquitto *m, void *data, int res) {
 		fprintf(stderr, "MQTT Error: Could not subscribe to %s: %d\n", STATE_TOPIC, ret);
 		exit(1);
 	}
+
+	ret = mosquitto_subscribe(m, NULL, SNAPSHOT_TOPIC, 1);
+	if (ret) {
+		fprintf(stderr, "MQTT Error: Could not subscribe to %s: %d\n", SNAPSHOT_TOPIC, ret);
+		exit(1);
+	}
 }
 
 static void on_disconnect(struct mosquitto *m, void *data, int res) {
@@ -167,21 +178,58 @@ static void on_disconnect(struct mosquitto *m, void *data, int res) {
 		return;
 
 	udata->state = STATE_DISCONNECTED;
+	udata->snapshot_seen = false;
 
 	fprintf(stderr, "MQTT Disconnected.\n");
 }
 
+static void on_snapshot_message(struct userdata *udata, const struct mosquitto_message *msg) {
+	struct snapshot snap;
+	const char *state;
+	int i;
+
+	if (!snapshot_unpack(&snap, msg->payload, msg->payloadlen)) {
+		fprintf(stderr, "Incorrect state snapshot received\n");
+		return;
+	}
+
+	if (udata->snapshot_seen && !snapshot_is_newer(&udata->snapshot, &snap))
+		return;
+
+	udata->snapshot = snap;
+	udata->snapshot_seen = true;
+
+	state = snapshot_state_str(snap.state);
+	for(i=0; i < STATE_MAX; i++) {
+		if(!strcmp(states[i], state)) {
+			udata->state = i;
+			break;
+		}
+	}
+
+	fprintf(stderr, "MQTT state snapshot %u: %s\n", snap.seq, states[udata->state]);
+}
+
 static void on_message(struct mosquitto *m, void *data, const struct mosquitto_message *msg) {
 	int i;
 	enum states2 curstate = STATE_UNKNOWN;
 	struct userdata *udata = (struct userdata*) data;
 
+	if(!strcmp(SNAPSHOT_TOPIC, msg->topic)) {
+		on_snapshot_message(udata, msg);
+		return;
+	}
+
 	/* wrong */
 	if(strcmp(STATE_TOPIC, msg->topic)) {
 		fprintf(stderr, "Ignored message with wrong topic\n");
 		return;
 	}
 
+	/* the snapshot carries the same information atomically */
+	if(udata->snapshot_seen)
+		return;
+
 	for(i=0; i < STATE_MAX; i++) {
 		if(!strncmp(states[i], msg->payload, msg->payloadlen)) {
 			curstate = i;
@@ -205,6 +253,7 @@ static int mosquitto_init(struct userdata *udata) {
 	int ret;
 
 	udata->state = STATE_UNKNOWN;
+	udata->snapshot_seen = false;
 
 	/* load mosquitto config */
 	FILE *cfg = cfg_open();
@@ -26,6 +26,7 @@
 #include <linux/gpio.h>
 #include "../keyboard/gpio.h"
 #include "../common/config.h"
+#include "../common/snapshot.h"
 
 #define TOPIC_CURRENT_STATE "/access-control-system/space-state"
 #define TOPIC_NEXT_STATE "/access-control-system/space-state-next"
@@ -92,9 +93,14 @@ static bool remove_file(const char *dir, const char *filename) {
 
 int main(int argc, char **argv) {
 	struct mosquitto *mosq;
-	struct gpioevent_data event;
+	struct gpiogroup chip[1] = {};
+	struct gpio_edge edges[GPIO_GROUP_MAX_EVENTS];
 	int ret = 0, i;
 	unsigned char old_gpios = 0xFF;
+	uint8_t gpioval = 0;
+	struct snapshot snapshot = { .source = SNAPSHOT_SOURCE_SWITCH };
+	uint8_t snapbuf[SNAPSHOT_MAX_SIZE];
+	int snaplen;
 
 	mosquitto_lib_init();
 
@@ -108,6 +114,8 @@ int main(int argc, char **argv) {
 	char *statedir = cfg_get_default(cfg, "statedir", STATEDIR);
 	cfg_close(cfg);
 
+	snapshot.seq = snapshot_seq_init();
+
 	/* create mosquitto client instance */
 	mosq = mosquitto_new("space-status-switch", true, NULL);
 	if(!mosq) {
@@ -150,52 +158,53 @@ int main(int argc, char **argv) {
 		return 1;
 	}
 
+	/* both switch contacts are on the same chip, request them together */
 	for (i = 0; gpios[i].dev; i++) {
-		int err = gpio_init(&gpios[i]);
-		if (err) {
-			fprintf(stderr, "could not init gpio \"%s\": %d!\n", gpios[i].name, err);
+		int err = gpio_group_add(chip, 1, &gpios[i], i, 0);
+		if (err < 0) {
+			fprintf(stderr, "could not add gpio \"%s\": %d!\n", gpios[i].name, err);
 			return 1;
 		}
 	}
 
+	ret = gpio_group_request(&chip[0]);
+	if (ret) {
+		fprintf(stderr, "could not init gpios: %d!\n", ret);
+		return 1;
+	}
+
 	ret = mosquitto_loop_start(mosq);
 	if (ret) {
 		fprintf(stderr, "Error could not start mosquitto network loop: %d\n", ret);
 		return 1;
 	}
 
-	struct pollfd fdset[2];
-	int nfds = 2;
+	struct pollfd fdset;
 
-	fdset[0].fd = gpios[0].evfd;
-	fdset[0].events = POLLIN;
-	fdset[1].fd = gpios[1].evfd;
-	fdset[1].events = POLLIN;
+	fdset.fd = chip[0].evfd;
+	fdset.events = POLLIN;
 
 	for (;;) {
-		ret = poll(fdset, nfds, GPIO_TIMEOUT);
+		ret = poll(&fdset, 1, GPIO_TIMEOUT);
 		if(ret < 0) {
 				fprintf(stderr, "Failed to poll gpios: %d\n", ret);
 				return 1;
 		}
 
-		uint8_t gpioval;
-		for (i = 0; i < nfds; i++) {
-			bool state;
-
-			if ((fdset[i].revents & POLLIN) == 0)
-				continue;
+		if ((fdset.revents & POLLIN) == 0)
+			continue;
 
-			ret = read(gpios[i].evfd, &event, sizeof(event));
-			if (ret < 0) {
-				fprintf(stderr, "read failed: %d\n", errno);
-				return 1;
-			}
+		ret = gpio_group_read(&chip[0], edges, GPIO_GROUP_MAX_EVENTS);
+		if (ret < 0) {
+			fprintf(stderr, "read failed: %d\n", ret);
+			return 1;
+		}
 
-			if (event.id == GPIOEVENT_EVENT_RISING_EDGE)
-				gpioval |= (1 << i);
+		for (i = 0; i < ret; i++) {
+			if (edges[i].value)
+				gpioval |= (1 << edges[i].id);
 			else
-				gpioval &= ~(1 << i);
+				gpioval &= ~(1 << edges[i].id);
 		}
 
 		if(gpioval != old_gpios) {
@@ -229,7 +238,16 @@ int main(int argc, char **argv) {
 			remove_file(statedir, "status-next");
 			remove_file(statedir, "message");
 
-			/* publish state */
+			/* publish state, aggregated first */
+			snapshot.seq++;
+			snapshot_set(&snapshot, 0, "", state_cur, state_next, "");
+			snaplen = snapshot_pack(&snapshot, snapbuf, sizeof(snapbuf));
+			ret = mosquitto_publish(mosq, NULL, SNAPSHOT_TOPIC, snaplen, snapbuf, 0, true);
+			if (ret) {
+				fprintf(stderr, "Error could not send message: %d\n", ret);
+				return 1;
+			}
+
 			ret = mosquitto_publish(mosq, NULL, TOPIC_CURRENT_STATE, strlen(state_cur), state_cur, 0, true);
 			if (ret) {
 				fprintf(stderr, "Error could not send message: %d\n", ret);
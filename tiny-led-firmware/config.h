@@ -1,9 +1,29 @@
 #ifndef __CONFIG_H
 #define __CONFIG_H
 
-/* must be an integer between 1 and 255, limited by max memory size of AVR */
+/*
+ * LEDs in the chain, an integer between 1 and 255. Costs no SRAM, the
+ * LEDs are streamed from their command slots and only the frame time
+ * (~40us per LED) limits it.
+ */
 #define LED_COUNT 50
 
+/* LEDs with their own command register, 8 byte each, at most 192 */
+#define LED_CMD_COUNT 36
+
+/*
+ * segments: LED ranges sharing one command register, 10 byte each, at
+ * most 29. A single write recolors the whole range.
+ */
+#define LED_SEG_COUNT 8
+
+/*
+ * LED writes the back buffer can hold until a commit, 5 byte each. A full
+ * copy of the register file does not fit into the SRAM, larger updates
+ * are applied immediately and flagged in the commit register.
+ */
+#define LED_STAGE_COUNT 12
+
 /* shift address to follow the standard format */
 #define I2C_ADDR  0x23 << 1
 
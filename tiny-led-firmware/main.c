@@ -1,14 +1,19 @@
 #include <avr/io.h>
+#include <avr/pgmspace.h>
 #include <util/delay.h>
 #include <stdbool.h>
 #include "ws2812.h"
 #include "i2c.h"
 
-struct LEDcmd { uint8_t g; uint8_t r; uint8_t b; uint8_t c; uint8_t h;};
+/* command slot: the registers as written and the color currently shown */
+struct LEDcmd { uint8_t g; uint8_t r; uint8_t b; uint8_t c; uint8_t h; struct cRGB cur;};
 
-static struct cRGB leds[LED_COUNT];
-static struct LEDcmd cmds[LED_COUNT];
-volatile static uint8_t update = 2;
+/* LED range sharing the command slot LED_CMD_COUNT + segment index */
+struct LEDseg { uint8_t first; uint8_t count; };
+
+static struct LEDcmd cmds[LED_CMD_COUNT + LED_SEG_COUNT];
+static struct LEDseg segs[LED_SEG_COUNT];
+volatile static bool update;
 
 #define LED_CMD_MASK	0xc0
 #define LED_CMD_SHIFT	6
@@ -19,39 +24,243 @@ volatile static uint8_t update = 2;
 
 #define LED_TIME_MASK	0x3f
 
+/*
+ * 256 / n rounded, for n = 2 .. 63 (0 and 1 are never looked up). Turns
+ * the per frame division by a number of steps into a multiplication,
+ * the ATtiny has no divider.
+ */
+static const uint8_t recip[LED_TIME_MASK + 1] PROGMEM = {
+	0xff, 0xff, 128, 85, 64, 51, 43, 37,
+	32, 28, 26, 23, 21, 20, 18, 17,
+	16, 15, 14, 13, 13, 12, 12, 11,
+	11, 10, 10, 9, 9, 9, 9, 8,
+	8, 8, 8, 7, 7, 7, 7, 7,
+	6, 6, 6, 6, 6, 6, 6, 5,
+	5, 5, 5, 5, 5, 5, 5, 5,
+	5, 4, 4, 4, 4, 4, 4, 4,
+};
+
+/* Fletcher-16 of the first [LEN] LED registers: write [LEN], read [HI] [LO] [LEN] */
+#define LED_REG_CHECKSUM	0xfe
+
+static uint8_t checksum_len = LED_CMD_COUNT;
+
+/* segment commands [R] [G] [B] [C] and ranges [FIRST] [COUNT] [0] [0] */
+#define LED_REG_SEGMENT		0xc0
+#define LED_REG_SEGDEF		0xe0
+#define LED_SLOT_NONE		0xff
+
+/* write [BEGIN] to stage the following LED writes, [APPLY] to commit them */
+#define LED_REG_COMMIT		0xfd
+#define LED_COMMIT_BEGIN	0x01
+#define LED_COMMIT_APPLY	0x02
+
+#if LED_CMD_COUNT > LED_REG_SEGMENT || LED_SEG_COUNT > LED_REG_SEGDEF - LED_REG_SEGMENT || LED_SEG_COUNT > LED_REG_COMMIT - LED_REG_SEGDEF
+#error "LED_CMD_COUNT or LED_SEG_COUNT overlap the next register window"
+#endif
+
+/* back buffer: staged LED writes in arrival order */
+struct LEDstage { uint8_t reg; struct i2c_data val; };
+
+static struct LEDstage stage[LED_STAGE_COUNT];
+static uint8_t stage_count;
+static bool staging;
+static bool stage_overflow;
+
 static void led_worker();
 
+/* command slot shown on LED i, the first segment covering it wins */
+static uint8_t led_slot(uint8_t i) {
+	uint8_t s;
+
+	for (s = 0; s < LED_SEG_COUNT; s++)
+		if ((uint8_t) (i - segs[s].first) < segs[s].count)
+			return LED_CMD_COUNT + s;
+
+	return (i < LED_CMD_COUNT) ? i : LED_SLOT_NONE;
+}
+
+/* command slot behind a register, LED registers read as shown */
+static uint8_t reg_slot(uint8_t reg, bool shown) {
+	if (reg < LED_CMD_COUNT)
+		return shown ? led_slot(reg) : reg;
+
+	if (reg >= LED_REG_SEGMENT && reg < LED_REG_SEGMENT + LED_SEG_COUNT)
+		return LED_CMD_COUNT + reg - LED_REG_SEGMENT;
+
+	return LED_SLOT_NONE;
+}
+
+static bool reg_valid(uint8_t reg) {
+	if (reg >= LED_REG_SEGDEF && reg < LED_REG_SEGDEF + LED_SEG_COUNT)
+		return true;
+
+	return reg_slot(reg, false) != LED_SLOT_NONE;
+}
+
+static uint16_t checksum() {
+	uint8_t sum1 = 0, sum2 = 0;
+	uint8_t i, j;
+
+	for (i = 0; i < checksum_len; i++) {
+		struct LEDcmd *cmd = &cmds[led_slot(i)];
+
+		/* same byte order as a register read */
+		uint8_t regs[4] = { cmd->r, cmd->g, cmd->b, cmd->c };
+
+		/* mod 255 without a division */
+		for (j = 0; j < 4; j++) {
+			sum1 += regs[j];
+			if (sum1 < regs[j] || sum1 == 255)
+				sum1 -= 255;
+			sum2 += sum1;
+			if (sum2 < sum1 || sum2 == 255)
+				sum2 -= 255;
+		}
+	}
+
+	return (sum2 << 8) | sum1;
+}
+
+static void led_set_cmd(uint8_t reg, struct i2c_data val) {
+	struct LEDcmd *cmd;
+
+	if (reg >= LED_REG_SEGDEF) {
+		segs[reg - LED_REG_SEGDEF].first = val.data0;
+		segs[reg - LED_REG_SEGDEF].count = val.data1;
+		return;
+	}
+
+	cmd = &cmds[reg_slot(reg, false)];
+	cmd->r = val.data0;
+	cmd->g = val.data1;
+	cmd->b = val.data2;
+	cmd->c = val.data3;
+	cmd->h = 0x00;
+}
+
+static void stage_apply() {
+	uint8_t i;
+
+	for (i = 0; i < stage_count; i++)
+		led_set_cmd(stage[i].reg, stage[i].val);
+
+	stage_count = 0;
+}
+
+/*
+ * led_worker() keeps interrupts off from the first animation step to the
+ * last LED sent, the USI handlers only run between two frames. Applying
+ * from the interrupt handler therefore always happens at a frame boundary.
+ */
+static void stage_commit(uint8_t cmd) {
+	if (cmd == LED_COMMIT_BEGIN) {
+		stage_count = 0;
+		stage_overflow = false;
+		staging = true;
+	} else if (cmd == LED_COMMIT_APPLY && staging) {
+		staging = false;
+		stage_apply();
+	}
+}
+
 void i2c_recv(uint8_t reg, struct i2c_data val) {
-	if (reg >= LED_COUNT)
+	if (reg == LED_REG_COMMIT) {
+		stage_commit(val.data0);
 		return;
+	}
 
-	cmds[reg].r = val.data0;
-	cmds[reg].g = val.data1;
-	cmds[reg].b = val.data2;
-	cmds[reg].c = val.data3;
-	cmds[reg].h = 0x00;
+	if (reg == LED_REG_CHECKSUM) {
+		checksum_len = (val.data0 && val.data0 < LED_CMD_COUNT) ? val.data0 : LED_CMD_COUNT;
+		return;
+	}
+
+	if (!reg_valid(reg))
+		return;
+
+	if (staging && stage_count < LED_STAGE_COUNT) {
+		stage[stage_count].reg = reg;
+		stage[stage_count].val = val;
+		stage_count++;
+		return;
+	}
+
+	/* larger than the back buffer, the host can see this in the commit register */
+	if (staging)
+		stage_overflow = true;
+
+	led_set_cmd(reg, val);
 }
 
 void i2c_send(uint8_t reg, struct i2c_data *val) {
-	if (reg >= LED_COUNT)
+	struct LEDcmd *cmd;
+	uint16_t sum;
+	uint8_t slot;
+
+	if (reg == LED_REG_COMMIT) {
+		val->data0 = stage_count;
+		val->data1 = stage_overflow;
+		val->data2 = 0x00;
+		val->data3 = 0x00;
+		return;
+	}
+
+	if (reg == LED_REG_CHECKSUM) {
+		sum = checksum();
+		val->data0 = sum >> 8;
+		val->data1 = sum & 0xff;
+		val->data2 = checksum_len;
+		val->data3 = 0x00;
+		return;
+	}
+
+	if (reg >= LED_REG_SEGDEF && reg < LED_REG_SEGDEF + LED_SEG_COUNT) {
+		val->data0 = segs[reg - LED_REG_SEGDEF].first;
+		val->data1 = segs[reg - LED_REG_SEGDEF].count;
+		val->data2 = 0x00;
+		val->data3 = 0x00;
+		return;
+	}
+
+	slot = reg_slot(reg, true);
+	if (slot == LED_SLOT_NONE)
 		return;
 
-	val->data0 = cmds[reg].r;
-	val->data1 = cmds[reg].g;
-	val->data2 = cmds[reg].b;
-	val->data3 = cmds[reg].c;
+	cmd = &cmds[slot];
+	val->data0 = cmd->r;
+	val->data1 = cmd->g;
+	val->data2 = cmd->b;
+	val->data3 = cmd->c;
 }
 
 static void leds_init() {
 	struct i2c_data init = {5,5,5,0};
 	int i;
 
-	for(i=0; i < LED_COUNT; i++)
+	for(i=0; i < LED_CMD_COUNT; i++)
 		i2c_recv(i, init);
 
 	led_worker();
+}
+
+/* 8 x 8 -> 16 bit shift and add, the ATtiny has no multiplier either */
+static uint16_t mul8(uint8_t a, uint8_t b) {
+	uint16_t result = 0;
+	uint16_t x = a;
 
-	ws2812_setleds(leds, LED_COUNT);
+	while (b) {
+		if (b & 1)
+			result += x;
+		x <<= 1;
+		b >>= 1;
+	}
+
+	return result;
+}
+
+/* diff / steps, rounded to nearest */
+static uint8_t fade_change(uint8_t diff, uint8_t steps) {
+	return (mul8(diff, pgm_read_byte(&recip[steps])) + 0x80) >> 8;
 }
 
 static void fade_step_color(uint8_t *old, uint8_t new, uint8_t steps) {
@@ -59,6 +268,7 @@ static void fade_step_color(uint8_t *old, uint8_t new, uint8_t steps) {
 	uint8_t diff;
 	uint8_t change;
 
+	/* the last step always lands exactly on the target */
 	if (steps <= 1) {
 		*old = new;
 		return;
@@ -72,7 +282,8 @@ static void fade_step_color(uint8_t *old, uint8_t new, uint8_t steps) {
 		mode = true;
 	}
 
-	change = diff / steps;
+	/* rounding instead of truncation keeps small differences moving */
+	change = fade_change(diff, steps);
 
 	if (mode)
 		*old += change;
@@ -80,16 +291,10 @@ static void fade_step_color(uint8_t *old, uint8_t new, uint8_t steps) {
 		*old -= change;
 }
 
-static void fade_step_mode(uint8_t steps, uint8_t *cfg) {
-	steps--;
-
-	if (steps) {
-		/* decrease number of available steps */
-		*cfg = (LED_CMD_FADE << LED_CMD_SHIFT) | steps;
-	} else {
-		/* fading done, switch to set mode */
-		*cfg = 0x00;
-	}
+/* cur counts the steps done, the command byte stays as written by the host */
+static void fade_step_mode(uint8_t steps, uint8_t *cur) {
+	if (*cur < steps)
+		(*cur)++;
 }
 
 static void blink_step_color(uint8_t *old, uint8_t base, uint8_t cur) {
@@ -108,24 +313,21 @@ static void blink_step_mode(uint8_t steps, uint8_t *cur) {
 		*cur = 0x00;
 }
 
-static void glow_step_color(uint8_t *old, uint8_t base, uint8_t steps, uint8_t cur) {
+/* curstep / steps in 0.8 fixed point, 0 at both ends of the period */
+static uint8_t glow_factor(uint8_t steps, uint8_t cur) {
 	uint8_t curstep = cur & LED_TIME_MASK;
+	uint16_t factor;
 
-	/* calculate new color value */
-	uint16_t val = base >> 2; /* 25% */
-	val *= curstep;
-	val /= steps;
-	val %= 256;
-
-	val = base - val;
+	if (curstep == 0 || curstep >= steps)
+		return 0;
 
-	if (curstep == 0)
-		*old = base;
-	else if (curstep == steps)
-		*old = base;
-	else
-		*old = val;
+	factor = mul8(curstep, pgm_read_byte(&recip[steps]));
+	return (factor > 0xff) ? 0xff : factor;
+}
 
+/* dims by up to 25%, factor is computed once per LED and frame */
+static void glow_step_color(uint8_t *old, uint8_t base, uint8_t factor) {
+	*old = base - (mul8(base >> 2, factor) >> 8);
 }
 
 static void glow_step_mode(uint8_t steps, uint8_t *cur) {
@@ -147,39 +349,69 @@ static void glow_step_mode(uint8_t steps, uint8_t *cur) {
 	*cur = (mode << 7) | curstep;
 }
 
+static void cmd_step(struct LEDcmd *cmd) {
+	uint8_t factor;
+	uint8_t t = cmd->c & LED_TIME_MASK;
+	uint8_t c = (cmd->c & LED_CMD_MASK) >> LED_CMD_SHIFT;
+	switch(c) {
+		case LED_CMD_SET:
+			cmd->cur.r = cmd->r;
+			cmd->cur.g = cmd->g;
+			cmd->cur.b = cmd->b;
+			break;
+		case LED_CMD_FADE:
+			fade_step_color(&cmd->cur.r, cmd->r, t - cmd->h);
+			fade_step_color(&cmd->cur.g, cmd->g, t - cmd->h);
+			fade_step_color(&cmd->cur.b, cmd->b, t - cmd->h);
+			fade_step_mode(t, &cmd->h);
+			break;
+		case LED_CMD_BLINK:
+			blink_step_color(&cmd->cur.r, cmd->r, cmd->h);
+			blink_step_color(&cmd->cur.g, cmd->g, cmd->h);
+			blink_step_color(&cmd->cur.b, cmd->b, cmd->h);
+			blink_step_mode(t, &cmd->h);
+			break;
+		case LED_CMD_GLOW:
+			factor = glow_factor(t, cmd->h);
+			glow_step_color(&cmd->cur.r, cmd->r, factor);
+			glow_step_color(&cmd->cur.g, cmd->g, factor);
+			glow_step_color(&cmd->cur.b, cmd->b, factor);
+			glow_step_mode(t, &cmd->h);
+			break;
+	}
+}
+
+/*
+ * Animations run once per command slot, a segment costs the same as a
+ * single LED. There is no frame buffer, each LED is streamed from its
+ * slot: the gap between two LEDs is a segment table walk, far below the
+ * ws2812b latch time.
+ *
+ * The whole frame is one interrupt-free window of a few ms: the ws2812
+ * driver restores the interrupt flag instead of enabling it, so the
+ * per LED sends stay inside the cli() below. The USI keeps working
+ * meanwhile and stretches SCL after a start condition or a received
+ * byte until its interrupt is served, so the host just sees a slow bus,
+ * while the registers never change during a frame and an interrupt can
+ * not delay the LED stream past the latch time.
+ */
 static void led_worker() {
-	int i;
+	static struct cRGB off;
+	uint8_t i, slot;
+
+	cli();
+
+	for (i=0; i < LED_CMD_COUNT + LED_SEG_COUNT; i++)
+		cmd_step(&cmds[i]);
+
 	for (i=0; i < LED_COUNT; i++) {
-		uint8_t t = cmds[i].c & LED_TIME_MASK;
-		uint8_t c = (cmds[i].c & LED_CMD_MASK) >> LED_CMD_SHIFT;
-		switch(c) {
-			case LED_CMD_SET:
-				leds[i].r = cmds[i].r;
-				leds[i].g = cmds[i].g;
-				leds[i].b = cmds[i].b;
-				break;
-			case LED_CMD_FADE:
-				fade_step_color(&leds[i].r, cmds[i].r, t);
-				fade_step_color(&leds[i].g, cmds[i].g, t);
-				fade_step_color(&leds[i].b, cmds[i].b, t);
-				fade_step_mode(t, &cmds[i].c);
-				break;
-			case LED_CMD_BLINK:
-				blink_step_color(&leds[i].r, cmds[i].r, cmds[i].h);
-				blink_step_color(&leds[i].g, cmds[i].g, cmds[i].h);
-				blink_step_color(&leds[i].b, cmds[i].b, cmds[i].h);
-				blink_step_mode(t, &cmds[i].h);
-				break;
-			case LED_CMD_GLOW:
-				glow_step_color(&leds[i].r, cmds[i].r, t, cmds[i].h);
-				glow_step_color(&leds[i].g, cmds[i].g, t, cmds[i].h);
-				glow_step_color(&leds[i].b, cmds[i].b, t, cmds[i].h);
-				glow_step_mode(t, &cmds[i].h);
-				break;
-		}
+		slot = led_slot(i);
+		ws2812_sendarray((uint8_t *) (slot == LED_SLOT_NONE ? &off : &cmds[slot].cur), sizeof(off));
 	}
 
-	ws2812_setleds(leds, LED_COUNT);
+	sei();
+
+	_delay_us(50);
 }
 
 static void timer_init() {
@@ -192,61 +424,27 @@ static void timer_init() {
 
 	/* 32Hz = 31.25ms = 250000 instructions */
 	/* 32Hz means, LED cfg (2**6) can count up to 2 seconds */
-	/* 50 ws2812b LEDs: 50*3*1.25us + 10us = ~0.2ms */
-	/* so we have > 30ms to calculate LED colors */
-}
-
-static void timer_disable() {
-		TIMSK &= ~(1<<OCIE1A);
+	/* 50 ws2812b LEDs: 50*(3*8*1.25us + ~10us) = ~2ms */
+	/* so we have > 30ms to calculate LED colors, but every ms of */
+	/* led_worker() is a ms of I2C clock stretching */
 }
 
 ISR(TIMER1_COMPA_vect) {
-	update = 1;
-}
-
-static void check_modepin() {
-    static bool state = true;
-	bool newstate = (PINB & (1 << PB3));
-
-	if (state == newstate)
-		return;
-	state = newstate;
-
-	if (PINB & (1 << PB3)) {
-		timer_disable();
-		i2c_enable();
-
-		update = 2;
-	} else {
-		timer_init();
-		i2c_disable();
-
-		update = 1;
-	}
-}
-
-static void mode_init() {
-	DDRB |= 1 << PB3;  /* input mode */
-	PORTB |= 1 << PB3; /* pull-up */
+	update = true;
 }
 
 void main(void)
 {
 	leds_init();
 	i2c_init(I2C_ADDR);
-	timer_disable();
+	timer_init();
 
 	while(1) {
+		if (!update)
+			continue;
 
-		switch (update) {
-			case 0:
-				break;
-			case 1:
-				led_worker();
-				update = 0;
-			default:
-				check_modepin();
-				break;
-		}
+		/* a frame taking longer than the timer period skips the next one */
+		update = false;
+		led_worker();
 	}
 }
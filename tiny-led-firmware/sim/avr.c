@@ -0,0 +1,151 @@
+/*
+ * Runtime of the host simulator: registers, interrupt flag, busy waits,
+ * the ws2812 output and the USI driver. Built without coverage
+ * instrumentation, so only firmware code is counted as basic blocks.
+ */
+
+#include <string.h>
+#include <avr/io.h>
+#include <avr/interrupt.h>
+#include <util/delay.h>
+#include "ws2812.h"
+#include "i2c.h"
+#include "sim.h"
+
+volatile uint8_t DDRB, PORTB, PINB;
+volatile uint8_t TCCR1, OCR1C, TIMSK;
+volatile uint8_t USICR, USISR, USIDR;
+
+unsigned long sim_block_cycles = SIM_BLOCK_CYCLES;
+
+static volatile bool profiling;
+static unsigned long cycles;
+static unsigned long profile_start;
+
+static bool irq_off;
+static unsigned long irq_off_start;
+static unsigned long irq_off_max;
+
+static uint8_t frame[SIM_FRAME_MAX];
+static int frame_len;
+
+/* LED stream checks of the current frame */
+static bool irq_opened;
+static bool stream_uncovered;
+static bool stream_irq_window;
+
+/* called by -fsanitize-coverage=trace-pc for every basic block */
+void __sanitizer_cov_trace_pc(void) {
+	if (profiling)
+		cycles += sim_block_cycles;
+}
+
+void sim_profile_begin(void) {
+	profile_start = cycles;
+	profiling = true;
+}
+
+unsigned long sim_profile_end(void) {
+	profiling = false;
+	return cycles - profile_start;
+}
+
+unsigned long sim_irq_off_max(void) {
+	return irq_off_max;
+}
+
+void sim_cli(void) {
+	if (irq_off)
+		return;
+
+	irq_off = true;
+	irq_off_start = cycles;
+}
+
+void sim_sei(void) {
+	if (!irq_off)
+		return;
+
+	irq_off = false;
+	if (frame_len)
+		irq_opened = true;
+	if (cycles - irq_off_start > irq_off_max)
+		irq_off_max = cycles - irq_off_start;
+}
+
+void sim_delay_us(double us) {
+	if (profiling)
+		cycles += us * (F_CPU / 1000000);
+}
+
+const uint8_t *sim_frame(int *len) {
+	*len = frame_len;
+	return frame;
+}
+
+void sim_frame_reset(void) {
+	frame_len = 0;
+	irq_opened = false;
+	stream_uncovered = false;
+	stream_irq_window = false;
+}
+
+bool sim_stream_uncovered(void) {
+	return stream_uncovered;
+}
+
+bool sim_stream_irq_window(void) {
+	return stream_irq_window;
+}
+
+/* like the driver: cli() while sending, then SREG is restored */
+void ws2812_sendarray_mask(uint8_t *data, uint16_t datlen, uint8_t maskhi) {
+	bool irq_prev = irq_off;
+
+	if (!irq_prev)
+		stream_uncovered = true;
+	if (irq_opened)
+		stream_irq_window = true;
+
+	sim_cli();
+
+	if (profiling)
+		cycles += SIM_WS2812_CALL_CYCLES + datlen * 8 * SIM_WS2812_BIT_CYCLES;
+
+	if (datlen > SIM_FRAME_MAX - frame_len)
+		datlen = SIM_FRAME_MAX - frame_len;
+
+	memcpy(frame + frame_len, data, datlen);
+	frame_len += datlen;
+
+	if (!irq_prev)
+		sim_sei();
+}
+
+void ws2812_sendarray(uint8_t *data, uint16_t datlen) {
+	ws2812_sendarray_mask(data, datlen, _BV(WS2812_PIN));
+}
+
+void ws2812_setleds_pin(struct cRGB *ledarray, uint16_t leds, uint8_t pinmask) {
+	ws2812_sendarray_mask((uint8_t *) ledarray, leds * 3, pinmask);
+	_delay_us(50);
+}
+
+void ws2812_setleds(struct cRGB *ledarray, uint16_t leds) {
+	ws2812_setleds_pin(ledarray, leds, _BV(WS2812_PIN));
+}
+
+void ws2812_setleds_rgbw(struct cRGBW *ledarray, uint16_t leds) {
+	ws2812_sendarray_mask((uint8_t *) ledarray, leds * 4, _BV(WS2812_PIN));
+	_delay_us(80);
+}
+
+/* the simulator calls i2c_recv() and i2c_send() directly */
+void i2c_init(uint8_t own_address) {
+}
+
+void i2c_enable() {
+}
+
+void i2c_disable() {
+}
@@ -0,0 +1,15 @@
+#ifndef __SIM_AVR_INTERRUPT_H
+#define __SIM_AVR_INTERRUPT_H
+
+/* interrupts are never raised, the simulator calls the handlers directly */
+
+void sim_cli(void);
+void sim_sei(void);
+
+#define cli() sim_cli()
+#define sei() sim_sei()
+
+#define ISR(vector) void vector(void)
+#define TIMER1_COMPA_vect sim_timer1_compa_vect
+
+#endif
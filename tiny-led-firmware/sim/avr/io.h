@@ -0,0 +1,22 @@
+#ifndef __SIM_AVR_IO_H
+#define __SIM_AVR_IO_H
+
+/* host stand-in for the ATtiny85 registers used by the firmware */
+
+#include <stdint.h>
+
+extern volatile uint8_t DDRB, PORTB, PINB;
+extern volatile uint8_t TCCR1, OCR1C, TIMSK;
+extern volatile uint8_t USICR, USISR, USIDR;
+
+#define PB0 0
+#define PB1 1
+#define PB2 2
+#define PB3 3
+
+#define OCIE1A 6
+#define USIOIE 6
+
+#define _BV(bit) (1 << (bit))
+
+#endif
@@ -0,0 +1,9 @@
+#ifndef __SIM_AVR_PGMSPACE_H
+#define __SIM_AVR_PGMSPACE_H
+
+#include <stdint.h>
+
+#define PROGMEM
+#define pgm_read_byte(addr) (*(const uint8_t *) (addr))
+
+#endif
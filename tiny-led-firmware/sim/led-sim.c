@@ -0,0 +1,326 @@
+/*
+ * Host simulator for the LED firmware: replays I2C command scripts, dumps
+ * the rendered frames and profiles led_worker() against the 32 Hz frame
+ * budget. See README.txt for the script format.
+ */
+
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include "sim.h"
+
+#define main firmware_main
+#include "../main.c"
+#undef main
+
+/* cycles between two timer ticks */
+#define FRAME_BUDGET (F_CPU / 32)
+
+#define SCRIPT_BYTES_MAX 256
+
+struct profile {
+	unsigned long calls;
+	unsigned long min;
+	unsigned long max;
+	unsigned long total;
+};
+
+static struct profile worker = { .min = ~0UL };
+static unsigned long stream_uncovered;
+static unsigned long stream_irq_window;
+static unsigned long frame_no;
+static uint8_t frame_last[SIM_FRAME_MAX];
+static int frame_last_len = -1;
+static bool verbose;
+
+/* LED chain in R G B order, only when it changed since the last dump */
+static void frame_dump(FILE *out) {
+	const uint8_t *buf;
+	int len, i;
+
+	buf = sim_frame(&len);
+	if (len == frame_last_len && !memcmp(buf, frame_last, len))
+		return;
+
+	/* the ws2812 takes G R B */
+	fprintf(out, "frame %lu:", frame_no);
+	for (i = 0; i + 2 < len; i += 3)
+		fprintf(out, " %02x%02x%02x", buf[i + 1], buf[i], buf[i + 2]);
+	fprintf(out, "\n");
+
+	memcpy(frame_last, buf, len);
+	frame_last_len = len;
+}
+
+/* one timer tick */
+static void render(FILE *out) {
+	unsigned long cycles;
+
+	frame_no++;
+	sim_frame_reset();
+
+	sim_profile_begin();
+	led_worker();
+	cycles = sim_profile_end();
+
+	worker.calls++;
+	worker.total += cycles;
+	if (cycles < worker.min)
+		worker.min = cycles;
+	if (cycles > worker.max)
+		worker.max = cycles;
+
+	/* the frame must be one interrupt-free window, see led_worker() */
+	if (sim_stream_uncovered())
+		stream_uncovered++;
+	if (sim_stream_irq_window())
+		stream_irq_window++;
+
+	if (verbose)
+		fprintf(stderr, "frame %lu: %lu cycles\n", frame_no, cycles);
+
+	frame_dump(out);
+}
+
+/* same as the USI driver: every complete 4 byte word is one register */
+static void i2c_write(uint8_t reg, const uint8_t *data, int len) {
+	struct i2c_data val;
+
+	for (; len >= 4; len -= 4, data += 4) {
+		val = (struct i2c_data) { data[0], data[1], data[2], data[3] };
+		i2c_recv(reg++, val);
+	}
+}
+
+static void i2c_read(uint8_t reg, uint8_t *data, int len) {
+	static struct i2c_data val;
+	int i;
+
+	for (i = 0; i < len; i++) {
+		if (i % 4 == 0)
+			i2c_send(reg++, &val);
+		data[i] = ((uint8_t *) &val)[i % 4];
+	}
+}
+
+static int parse_byte(const char *tok, uint8_t *val) {
+	unsigned long n;
+	char *end;
+
+	if (!tok)
+		return -EINVAL;
+
+	n = strtoul(tok, &end, 0);
+	if (*end || n > 0xff)
+		return -EINVAL;
+
+	*val = n;
+	return 0;
+}
+
+/* write <reg> <byte>... | read <reg> <count> | frames <count> */
+static int script_line(char *line, FILE *out) {
+	uint8_t data[SCRIPT_BYTES_MAX];
+	char *cmd, *tok;
+	uint8_t reg;
+	long count;
+	int i, len = 0;
+
+	cmd = strtok(line, " \t\r\n");
+	if (!cmd)
+		return 0;
+
+	if (!strcmp(cmd, "frames")) {
+		tok = strtok(NULL, " \t\r\n");
+		count = tok ? strtol(tok, NULL, 0) : 0;
+		if (count <= 0)
+			return -EINVAL;
+
+		while (count--)
+			render(out);
+		return 0;
+	}
+
+	if (parse_byte(strtok(NULL, " \t\r\n"), &reg))
+		return -EINVAL;
+
+	while ((tok = strtok(NULL, " \t\r\n"))) {
+		if (len == SCRIPT_BYTES_MAX || parse_byte(tok, &data[len]))
+			return -EINVAL;
+		len++;
+	}
+
+	if (!strcmp(cmd, "write")) {
+		i2c_write(reg, data, len);
+		return 0;
+	}
+
+	if (!strcmp(cmd, "read") && len == 1 && data[0]) {
+		len = data[0];
+		i2c_read(reg, data, len);
+
+		fprintf(out, "read 0x%02x:", reg);
+		for (i = 0; i < len; i++)
+			fprintf(out, " %02x", data[i]);
+		fprintf(out, "\n");
+		return 0;
+	}
+
+	return -EINVAL;
+}
+
+static int script_run(const char *path, FILE *out) {
+	char *line = NULL, *p;
+	size_t size = 0;
+	int lineno, ret = 0;
+	FILE *f;
+
+	f = fopen(path, "r");
+	if (!f) {
+		fprintf(stderr, "could not open %s\n", path);
+		return -errno;
+	}
+
+	for (lineno = 1; getline(&line, &size, f) > 0; lineno++) {
+		p = strchr(line, '#');
+		if (p)
+			*p = '\0';
+
+		ret = script_line(line, out);
+		if (ret) {
+			fprintf(stderr, "%s:%d: invalid command\n", path, lineno);
+			break;
+		}
+	}
+
+	free(line);
+	fclose(f);
+	return ret;
+}
+
+/* returns true if the dump equals the golden file */
+static bool golden_compare(const char *path, const char *dump, size_t len) {
+	char *line = NULL;
+	size_t size = 0, pos = 0;
+	ssize_t n;
+	int lineno;
+	bool equal = true;
+	FILE *f;
+
+	f = fopen(path, "r");
+	if (!f) {
+		fprintf(stderr, "could not open %s\n", path);
+		return false;
+	}
+
+	for (lineno = 1; (n = getline(&line, &size, f)) > 0; lineno++) {
+		if ((size_t) n > len - pos || memcmp(dump + pos, line, n)) {
+			equal = false;
+			break;
+		}
+		pos += n;
+	}
+
+	if (equal && pos != len)
+		equal = false;
+
+	if (!equal)
+		fprintf(stderr, "%s:%d: rendered output differs\n", path, lineno);
+
+	free(line);
+	fclose(f);
+	return equal;
+}
+
+static void report() {
+	fprintf(stderr, "led_worker: %lu frames, %lu/%lu/%lu cycles min/avg/max, budget %lu (max %.1f%%)\n",
+		worker.calls, worker.calls ? worker.min : 0, worker.calls ? worker.total / worker.calls : 0,
+		worker.max, (unsigned long) FRAME_BUDGET, 100.0 * worker.max / FRAME_BUDGET);
+	fprintf(stderr, "interrupts off: max %lu cycles (%.2f ms of I2C clock stretching)\n",
+		sim_irq_off_max(), sim_irq_off_max() * 1000.0 / F_CPU);
+	fprintf(stderr, "LED stream: %lu frames not covered by the window, %lu frames with I2C served mid-stream\n",
+		stream_uncovered, stream_irq_window);
+	fprintf(stderr, "sram: %zu byte LED state (commands %zu, segments %zu, back buffer %zu)\n",
+		sizeof(cmds) + sizeof(segs) + sizeof(stage), sizeof(cmds), sizeof(segs), sizeof(stage));
+}
+
+static void usage(const char *name) {
+	fprintf(stderr, "%s [-b cycles] [-g golden] [-v] <script>\n", name);
+	fprintf(stderr, "\tcycles: cost of a basic block, default %d\n", SIM_BLOCK_CYCLES);
+	fprintf(stderr, "\tgolden: compare the rendered frames instead of printing them\n");
+	fprintf(stderr, "\t-v:     print the cycles of every frame\n");
+}
+
+int main(int argc, char **argv) {
+	const char *golden = NULL;
+	char *dump = NULL;
+	size_t dumplen = 0;
+	FILE *out;
+	int opt, ret = 0;
+
+	while ((opt = getopt(argc, argv, "b:g:v")) != -1) {
+		switch (opt) {
+			case 'b':
+				sim_block_cycles = strtoul(optarg, NULL, 0);
+				break;
+			case 'g':
+				golden = optarg;
+				break;
+			case 'v':
+				verbose = true;
+				break;
+			default:
+				usage(argv[0]);
+				return 1;
+		}
+	}
+
+	if (optind >= argc) {
+		usage(argv[0]);
+		return 1;
+	}
+
+	out = open_memstream(&dump, &dumplen);
+	if (!out) {
+		fprintf(stderr, "Error: Out of memory.\n");
+		return 1;
+	}
+
+	/* power on, the first frame is rendered from the init values */
+	leds_init();
+	frame_dump(out);
+
+	if (script_run(argv[optind], out))
+		ret = 1;
+
+	fclose(out);
+
+	if (!golden)
+		fwrite(dump, 1, dumplen, stdout);
+	else if (!golden_compare(golden, dump, dumplen))
+		ret = 1;
+
+	report();
+
+	if (worker.max > FRAME_BUDGET) {
+		fprintf(stderr, "led_worker exceeds the frame budget\n");
+		ret = 1;
+	}
+
+	if (stream_uncovered) {
+		fprintf(stderr, "led_worker streams LEDs with interrupts enabled\n");
+		ret = 1;
+	}
+
+	if (stream_irq_window) {
+		fprintf(stderr, "led_worker enables interrupts between two LEDs\n");
+		ret = 1;
+	}
+
+	free(dump);
+	return ret;
+}
@@ -0,0 +1,38 @@
+#ifndef __SIM_H
+#define __SIM_H
+
+#include <stdint.h>
+#include <stdbool.h>
+
+/*
+ * Cost model: every basic block of the firmware costs block_cycles, the
+ * ws2812 output and busy waits cost their exact time. Only counted
+ * between sim_profile_begin() and sim_profile_end().
+ */
+#define SIM_BLOCK_CYCLES 8
+
+/* ws2812 bit time and the setup around one send call */
+#define SIM_WS2812_BIT_CYCLES (F_CPU / 800000)
+#define SIM_WS2812_CALL_CYCLES 20
+
+#define SIM_FRAME_MAX (3 * 256)
+
+extern unsigned long sim_block_cycles;
+
+void sim_profile_begin(void);
+unsigned long sim_profile_end(void);
+
+/* longest interrupt-free window, the I2C clock stretch */
+unsigned long sim_irq_off_max(void);
+
+/* bytes sent to the LED chain since the last reset */
+const uint8_t *sim_frame(int *len);
+void sim_frame_reset(void);
+
+/* some LED of the frame was sent outside the caller's cli() window */
+bool sim_stream_uncovered(void);
+
+/* interrupts were enabled between two LEDs, an I2C handler could run */
+bool sim_stream_irq_window(void);
+
+#endif
@@ -0,0 +1,11 @@
+#ifndef __SIM_UTIL_DELAY_H
+#define __SIM_UTIL_DELAY_H
+
+/* busy waits only cost simulated cycles */
+
+void sim_delay_us(double us);
+
+#define _delay_us(us) sim_delay_us(us)
+#define _delay_ms(ms) sim_delay_us((ms) * 1000.0)
+
+#endif
@@ -182,7 +182,6 @@ w_nop16
     );
   }
   
-  SREG=sreg_prev;
-  sei();
+  SREG=sreg_prev;               // keeps a caller's cli() window open
 #endif
 }